@@ -2,11 +2,18 @@
 #include "catch.hpp"
 
 #include "hash_map.hpp"
+#include "concurrent_hash_map.hpp"
 
 #include <vector>
 #include <iostream>
 #include <time.h>
 #include <unordered_map>
+#include <map>
+#include <chrono>
+#include <string_view>
+#include <memory>
+#include <random>
+#include <thread>
 
 
 using namespace std;
@@ -28,6 +35,130 @@ TEST_CASE("Allocator", "[Allocator]") {
     }
 }
 
+TEST_CASE("Arena, pool and pmr allocators", "[Allocator]") {
+    fefu::arena arena1, arena2;
+    {
+        using Alloc = fefu::arena_allocator<pair<const int, string>>;
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> hmap{ Alloc(arena1) };
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> other{ Alloc(arena2) };
+        for (int i = 0; i < 1000; i++)
+            hmap[i] = to_string(i);
+        for (int i = 0; i < 500; i++)
+            hmap.erase(i);
+        other[-1] = "other";
+        other = hmap;
+        CHECK(other.size() == 500);
+        CHECK(other.at(999) == "999");
+        CHECK(other.get_allocator().resource() == &arena1);
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> moved(std::move(other));
+        other = std::move(moved);
+        CHECK(other.at(500) == "500");
+        hmap.clear();
+        hmap.swap(other);
+        CHECK(hmap.size() == 500);
+        CHECK(other.empty());
+        CHECK(hmap.get_allocator().resource() == &arena1);
+    }
+    arena1.release();
+    arena2.release();
+
+    fefu::pool pool, scratch;
+    for (int round = 0; round < 3; round++) {
+        using Alloc = fefu::pool_allocator<pair<const int, string>>;
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> hmap{ Alloc(pool) };
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> other{ Alloc(scratch) };
+        for (int i = 0; i < 1000; i++)
+            hmap[i] = to_string(i);
+        for (int i = 0; i < 500; i++)
+            hmap.erase(i);
+        other = hmap;
+        CHECK(other.at(999) == "999");
+        hmap.clear();
+        hmap.swap(other);
+        CHECK(hmap.size() == 500);
+        CHECK(hmap.get_allocator().resource() == &pool);
+    }
+
+    std::pmr::unsynchronized_pool_resource resource1, resource2;
+    {
+        using Alloc = fefu::pmr_allocator<pair<const int, string>>;
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> hmap{ Alloc(&resource1) };
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> other{ Alloc(&resource2) };
+        for (int i = 0; i < 1000; i++)
+            hmap[i] = to_string(i);
+        other = hmap;
+        CHECK(other.size() == 1000);
+        CHECK(other.get_allocator().resource() == &resource1);
+    }
+    {
+        // polymorphic_allocator stays with its container
+        using Alloc = std::pmr::polymorphic_allocator<pair<const int, string>>;
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> hmap{ Alloc(&resource1) };
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> other{ Alloc(&resource2) };
+        for (int i = 0; i < 1000; i++)
+            hmap[i] = to_string(i);
+        for (int i = 0; i < 500; i++)
+            hmap.erase(i);
+        other[-1] = "other";
+        other = hmap;
+        CHECK(other.size() == 500);
+        CHECK(other.at(999) == "999");
+        CHECK(other.get_allocator().resource() == &resource2);
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> moved(std::move(other));
+        other = std::move(moved);
+        CHECK(other.at(500) == "500");
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> shared(other, Alloc(&resource1));
+        hmap.clear();
+        hmap.swap(shared);
+        CHECK(hmap.size() == 500);
+        CHECK(shared.empty());
+        CHECK(hmap.get_allocator().resource() == &resource1);
+        // with unequal resources the elements move, the allocators stay
+        hmap.swap(other);
+        CHECK(hmap.at(999) == "999");
+        CHECK(other.at(500) == "500");
+        CHECK(hmap.get_allocator().resource() == &resource1);
+        CHECK(other.get_allocator().resource() == &resource2);
+    }
+}
+
+TEST_CASE("Huge page allocator", "[Allocator]") {
+    fefu::hash_map<int, int, hash<int>, equal_to<int>, fefu::huge_page_allocator<pair<const int, int>>> hmap;
+    for (int i = 0; i < 300000; i++)
+        hmap[i] = i;
+    REQUIRE(hmap.bucket_count() * sizeof(pair<const int, int>) > fefu::huge_page_allocator<char>::huge_page);
+    for (int i = 0; i < 300000; i += 1000)
+        CHECK(hmap.at(i) == i);
+    auto copy = hmap;
+    CHECK(copy == hmap);
+}
+
+TEST_CASE("Counting allocator, memory_usage()", "[Allocator]") {
+    using Alloc = fefu::counting_allocator<pair<const int, string>>;
+    fefu::allocation_counter counter;
+    {
+        fefu::hash_map<int, string, hash<int>, equal_to<int>, Alloc> hmap{ Alloc(counter) };
+        CHECK(hmap.memory_usage().total() == 0);
+        for (int i = 0; i < 1000; i++)
+            hmap[i] = to_string(i);
+        fefu::table_memory usage = hmap.memory_usage();
+        CHECK(usage.payload == 1000 * sizeof(pair<const int, string>));
+        CHECK(usage.wasted == (hmap.bucket_count() - 1000) * sizeof(pair<const int, string>));
+        CHECK(usage.metadata >= hmap.bucket_count());
+        CHECK(counter.live_bytes == usage.total());
+        CHECK(counter.peak_bytes >= counter.live_bytes);
+        CHECK(counter.allocations == counter.deallocations + 1);
+
+        hmap.incremental_rehash(1);
+        hmap.rehash(hmap.bucket_count() * 2);
+        for (int i = 1000; i < 2000; i++)
+            hmap[i] = to_string(i);
+        CHECK(counter.live_bytes == hmap.memory_usage().total());
+    }
+    CHECK(counter.live_bytes == 0);
+    CHECK(counter.allocations == counter.deallocations);
+}
+
 TEST_CASE("operator[]", "[hash_map]") {
     fefu::hash_map<int, string> hmap(10);
     hmap[2] = "abacaba";
@@ -58,6 +189,25 @@ TEST_CASE("bucket_count()", "[hash_map]") {
     CHECK(hmap.bucket_count() == 16);
 }
 
+TEST_CASE("empty table", "[hash_map]") {
+    // default and moved-from maps share the static control bytes
+    fefu::hash_map<int, string> hmap;
+    CHECK(hmap.bucket_count() == 0);
+    CHECK(hmap.begin() == hmap.end());
+    CHECK(hmap.find(3) == hmap.end());
+    CHECK(hmap.erase(3) == 0);
+
+    hmap[3] = "abc";
+    fefu::hash_map<int, string> moved(std::move(hmap));
+    CHECK(hmap.bucket_count() == 0);
+    CHECK(hmap.cbegin() == hmap.cend());
+    const fefu::hash_map<int, string> copy(hmap);
+    CHECK(copy.empty());
+    hmap[4] = "def";
+    CHECK(hmap.size() == 1);
+    CHECK(moved.at(3) == "abc");
+}
+
 TEST_CASE("bucket()", "[hash_map]") {
     fefu::hash_map<int, string> hmap(10);
     hmap[4] = "abc";
@@ -65,6 +215,113 @@ TEST_CASE("bucket()", "[hash_map]") {
     CHECK(t == hmap.bucket(4));
 }
 
+struct StringHash {
+    using is_transparent = void;
+
+    size_t operator()(string_view s) const {
+        return hash<string_view>{}(s);
+    }
+};
+
+TEST_CASE("transparent lookup", "[hash_map]") {
+    fefu::hash_map<string, int, StringHash, equal_to<>> hmap;
+    for (int i = 0; i < 100; i++)
+        hmap["key" + to_string(i)] = i;
+
+    string_view key = "key42";
+    CHECK(hmap.find(key)->second == 42);
+    CHECK(hmap.find(string_view("nokey")) == hmap.end());
+    CHECK(hmap.contains("key7"));
+    CHECK(hmap.count(string_view("key100")) == 0);
+    CHECK(hmap.at(key) == 42);
+    const auto& chmap = hmap;
+    CHECK(chmap.at("key3") == 3);
+    CHECK(chmap.find(key) != chmap.cend());
+    CHECK(hmap.bucket(key) == hmap.bucket(string("key42")));
+    CHECK_THROWS(hmap.at(string_view("nokey")));
+
+    CHECK(hmap.erase(key) == 1);
+    CHECK(hmap.erase(key) == 0);
+    CHECK(!hmap.contains(string("key42")));
+    CHECK(hmap.size() == 99);
+}
+
+TEST_CASE("pre-hashed operations", "[hash_map]") {
+    fefu::hash_map<string, int> first;
+    fefu::hash_map<string, int> second;
+    for (int i = 0; i < 50; i++) {
+        string key = to_string(i);
+        size_t hash = first.hash_key(key);
+        CHECK(hash == second.hash_key(key));
+        first.subscript_with_hash(key, hash) = i;
+        CHECK(second.try_emplace_with_hash(key, hash, i * 2).second);
+        CHECK(!second.try_emplace_with_hash(key, hash, 0).second);
+    }
+    CHECK(first.insert_with_hash(make_pair("x", 1), first.hash_key("x")).second);
+
+    string key = "7";
+    size_t hash = first.hash_key(key);
+    CHECK(first.find_with_hash(key, hash)->second == 7);
+    CHECK(second.contains_with_hash(key, hash));
+    CHECK(second.at(key) == 14);
+    CHECK(second.erase_with_hash(key, hash) == 1);
+    CHECK(!second.contains_with_hash(key, hash));
+    CHECK(second.find_with_hash(key, hash) == second.end());
+    CHECK(first.size() == 51);
+    CHECK(second.size() == 49);
+}
+
+TEST_CASE("find_many()", "[hash_map]") {
+    fefu::hash_map<int, string> hmap;
+    for (int i = 0; i < 100; i += 2)
+        hmap[i] = to_string(i);
+
+    vector<int> keys;
+    for (int i = 0; i < 100; i++)
+        keys.push_back((i * 37) % 100);
+    vector<fefu::hash_map<int, string>::iterator> found;
+    hmap.find_many(keys.begin(), keys.end(), back_inserter(found));
+    vector<bool> present(keys.size());
+    const auto& chmap = hmap;
+    CHECK(chmap.contains_many(keys.begin(), keys.end(), present.begin()) == present.end());
+    REQUIRE(found.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        CHECK(present[i] == (keys[i] % 2 == 0));
+        CHECK((found[i] != hmap.end()) == present[i]);
+        if (present[i])
+            CHECK(found[i]->first == keys[i]);
+    }
+
+    fefu::hash_map<int, string> empty;
+    vector<bool> none(3, true);
+    empty.contains_many(keys.begin(), keys.begin() + 3, none.begin());
+    CHECK(none == vector<bool>(3, false));
+}
+
+TEST_CASE("index policies", "[hash_map]") {
+    fefu::hash_map<int, int, hash<int>, equal_to<int>, fefu::allocator<pair<const int, int>>,
+        fefu::fibonacci_index_policy> fibHmap(10);
+    CHECK(fibHmap.bucket_count() == 16);
+
+    fefu::hash_map<int, int, hash<int>, equal_to<int>, fefu::allocator<pair<const int, int>>,
+        fefu::prime_index_policy> primeHmap(10);
+    CHECK(primeHmap.bucket_count() == 11);
+
+    for (int i = 0; i < 2000; i++) {
+        fibHmap[i * 1024] = i;
+        primeHmap[i * 1024] = i;
+    }
+    CHECK(fibHmap.size() == 2000);
+    CHECK(primeHmap.size() == 2000);
+    CHECK(primeHmap.bucket_count() % 2 == 1);
+    for (int i = 0; i < 2000; i++) {
+        REQUIRE(fibHmap.at(i * 1024) == i);
+        REQUIRE(primeHmap.at(i * 1024) == i);
+    }
+    CHECK(!fibHmap.contains(1));
+    CHECK(!primeHmap.contains(1));
+}
+
 TEST_CASE("rehash()", "[hash_map]") {
     fefu::hash_map<int, string> hmap(10);
     hmap[4] = "abc";
@@ -77,6 +334,272 @@ TEST_CASE("rehash()", "[hash_map]") {
     CHECK(hmap[2] == "bc");
 }
 
+// Largest number of elements a LimitedAllocator hands out at once.
+size_t allocationLimit = SIZE_MAX;
+
+template <typename T>
+struct LimitedAllocator {
+    using value_type = T;
+
+    LimitedAllocator() = default;
+    template <typename U>
+    LimitedAllocator(const LimitedAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > allocationLimit)
+            throw bad_alloc();
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const LimitedAllocator<U>&) const noexcept {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const LimitedAllocator<U>&) const noexcept {
+        return false;
+    }
+};
+
+TEST_CASE("rehash allocation failure", "[hash_map]") {
+    using LimitedMap = fefu::hash_map<int, string, hash<int>, equal_to<int>, LimitedAllocator<pair<const int, string>>>;
+    LimitedMap hmap;
+    for (int i = 0; i < 10; i++)
+        hmap[i] = to_string(i);
+    size_t buckets = hmap.bucket_count();
+    allocationLimit = 1 << 12;
+    CHECK_THROWS_AS(hmap.rehash(1 << 16), bad_alloc);
+    CHECK_THROWS_AS(hmap.reserve(1 << 16), bad_alloc);
+    CHECK(hmap.bucket_count() == buckets);
+    CHECK(hmap.size() == 10);
+    CHECK(std::distance(hmap.begin(), hmap.end()) == 10);
+    for (int i = 0; i < 10; i++)
+        CHECK(hmap.at(i) == to_string(i));
+
+    // the growth of an incremental rehash fails the same way
+    LimitedMap incremental;
+    incremental.incremental_rehash(1);
+    allocationLimit = SIZE_MAX;
+    int count = 0;
+    while (count < 100)
+        incremental[count++] = "incremental";
+    allocationLimit = incremental.bucket_count() * 2;
+    try {
+        while (true)
+            incremental[count++] = "incremental";
+    } catch (const bad_alloc&) {
+        count--;
+    }
+    allocationLimit = SIZE_MAX;
+    CHECK(incremental.size() == static_cast<size_t>(count));
+    CHECK(std::distance(incremental.begin(), incremental.end()) == count);
+    for (int i = 0; i < count; i++)
+        CHECK(incremental.contains(i));
+    incremental[count] = "incremental";
+    CHECK(incremental.size() == static_cast<size_t>(count) + 1);
+}
+
+struct CountedKey {
+    static int copies;
+
+    CountedKey(int v) : value(v) {}
+    CountedKey(const CountedKey& src) : value(src.value) { copies++; }
+    CountedKey(CountedKey&& src) = default;
+
+    bool operator==(const CountedKey& other) const {
+        return value == other.value;
+    }
+
+    int value;
+};
+
+int CountedKey::copies = 0;
+
+struct CountedKeyHash {
+    size_t operator()(const CountedKey& k) const noexcept {
+        return hash<int>{}(k.value);
+    }
+};
+
+TEST_CASE("rehash relocates keys", "[hash_map]") {
+    fefu::hash_map<CountedKey, string, CountedKeyHash> hmap;
+    fefu::hash_map<CountedKey, string, CountedKeyHash, equal_to<CountedKey>,
+        fefu::allocator<pair<const CountedKey, string>>, fefu::mask_index_policy, fefu::robin_hood_policy> robinHood;
+    CountedKey::copies = 0;
+    for (int i = 0; i < 1000; i++) {
+        hmap.try_emplace(i, to_string(i));
+        robinHood.try_emplace(i, to_string(i));
+    }
+    for (int i = 0; i < 1000; i += 3)
+        robinHood.erase(i);
+    hmap.rehash(10000);
+    CHECK(CountedKey::copies == 0);
+    CHECK(hmap.at(999) == "999");
+    CHECK(robinHood.at(998) == "998");
+}
+
+namespace fefu {
+    // a std::unique_ptr stays valid wherever its bytes are
+    template <>
+    struct is_trivially_relocatable<pair<const CountedKey, unique_ptr<int>>> : std::true_type {};
+}
+
+TEST_CASE("rehash copies the bytes of trivially relocatable elements", "[hash_map]") {
+    fefu::hash_map<CountedKey, unique_ptr<int>, CountedKeyHash> hmap;
+    CountedKey::copies = 0;
+    for (int i = 0; i < 1000; i++)
+        hmap.try_emplace(i, make_unique<int>(i));
+    hmap.rehash(10000);
+    CHECK(CountedKey::copies == 0);
+    for (int i = 0; i < 1000; i++)
+        CHECK(*hmap.at(i) == i);
+}
+
+// Throws once it was called budget times, never while budget is negative.
+struct ThrowingHash {
+    static int budget;
+
+    size_t operator()(int k) const {
+        if (budget == 0)
+            throw runtime_error("hash");
+        if (budget > 0)
+            budget--;
+        return hash<int>{}(k);
+    }
+};
+
+int ThrowingHash::budget = -1;
+
+// Copies, the only way it moves, throw like ThrowingHash.
+struct ThrowingCopy {
+    static int budget;
+
+    ThrowingCopy(int v) : value(v) {}
+    ThrowingCopy(const ThrowingCopy& src) : value(src.value) {
+        if (budget == 0)
+            throw runtime_error("copy");
+        if (budget > 0)
+            budget--;
+    }
+
+    int value;
+};
+
+int ThrowingCopy::budget = -1;
+
+TEST_CASE("rehash exception safety", "[hash_map]") {
+    fefu::hash_map<int, string, ThrowingHash> hashed;
+    fefu::hash_map<int, string, ThrowingHash, equal_to<int>, fefu::allocator<pair<const int, string>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> robinHood;
+    fefu::hash_map<int, ThrowingCopy> copied;
+    for (int i = 0; i < 100; i++) {
+        hashed[i] = to_string(i);
+        robinHood[i] = to_string(i);
+        copied.try_emplace(i, i);
+    }
+    size_t buckets = hashed.bucket_count();
+    ThrowingHash::budget = 10;
+    CHECK_THROWS(hashed.rehash(1000));
+    ThrowingHash::budget = 10;
+    CHECK_THROWS(robinHood.rehash(1000));
+    ThrowingHash::budget = -1;
+    ThrowingCopy::budget = 10;
+    CHECK_THROWS(copied.rehash(1000));
+    ThrowingCopy::budget = -1;
+
+    CHECK(hashed.bucket_count() == buckets);
+    CHECK(hashed.size() == 100);
+    CHECK(robinHood.size() == 100);
+    CHECK(copied.size() == 100);
+    CHECK(std::distance(hashed.begin(), hashed.end()) == 100);
+    CHECK(std::distance(robinHood.begin(), robinHood.end()) == 100);
+    CHECK(std::distance(copied.begin(), copied.end()) == 100);
+    for (int i = 0; i < 100; i++) {
+        CHECK(hashed.at(i) == to_string(i));
+        CHECK(robinHood.at(i) == to_string(i));
+        CHECK(copied.at(i).value == i);
+    }
+    copied.rehash(1000);
+    CHECK(copied.bucket_count() == 1024);
+    CHECK(copied.at(99).value == 99);
+}
+
+struct CountingHash {
+    static int calls;
+
+    size_t operator()(const string& k) const {
+        calls++;
+        return hash<string>{}(k);
+    }
+};
+
+int CountingHash::calls = 0;
+
+struct CountingCharHash {
+    static int calls;
+
+    size_t operator()(char k) const {
+        calls++;
+        return hash<char>{}(k);
+    }
+};
+
+int CountingCharHash::calls = 0;
+
+namespace fefu {
+    template <>
+    struct store_hash<CountingHash> : std::true_type {};
+
+    template <>
+    struct store_hash<CountingCharHash> : std::true_type {};
+}
+
+TEST_CASE("stored hashes", "[hash_map]") {
+    fefu::hash_map<string, int, CountingHash> hmap;
+    fefu::hash_map<string, int, CountingHash, equal_to<string>, fefu::allocator<pair<const string, int>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> robinHood;
+    for (int i = 0; i < 1000; i++) {
+        hmap["url" + to_string(i)] = i;
+        robinHood["url" + to_string(i)] = i;
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        CHECK(hmap.erase("url" + to_string(i)) == 1);
+        CHECK(robinHood.erase("url" + to_string(i)) == 1);
+    }
+
+    // neither growth nor erase shifting hashes the keys again
+    CountingHash::calls = 0;
+    hmap.rehash(10000);
+    robinHood.rehash(10000);
+    fefu::hash_map<string, int, CountingHash> copy(hmap);
+    CHECK(CountingHash::calls == 0);
+
+    for (int i = 0; i < 1000; i++) {
+        CHECK(hmap.contains("url" + to_string(i)) == (i % 3 != 0));
+        CHECK(robinHood.contains("url" + to_string(i)) == (i % 3 != 0));
+        CHECK(copy.contains("url" + to_string(i)) == (i % 3 != 0));
+    }
+    CHECK(copy.at("url5") == 5);
+
+    // the block of small elements from an arena is not aligned for the hashes
+    using Alloc = fefu::arena_allocator<pair<const char, char>>;
+    fefu::arena arena;
+    arena.allocate(1, 1);
+    fefu::hash_map<char, char, CountingCharHash, equal_to<char>, Alloc> chars{ Alloc(arena) };
+    for (char c = 'a'; c <= 'z'; c++)
+        chars[c] = c - 'a' + 'A';
+    CountingCharHash::calls = 0;
+    chars.rehash(256);
+    CHECK(CountingCharHash::calls == 0);
+    for (char c = 'a'; c <= 'z'; c++)
+        CHECK(chars.at(c) == c - 'a' + 'A');
+}
+
 TEST_CASE("reserve()", "[hash_map]") {
     fefu::hash_map<int, string> hmap(6);
     hmap[1] = "test";
@@ -90,6 +613,283 @@ TEST_CASE("reserve()", "[hash_map]") {
     CHECK(hmap[-1] == "test2");
 }
 
+TEST_CASE("growth policies and water marks", "[hash_map]") {
+    CHECK(fefu::doubling_growth_policy::grow(16) == 32);
+    CHECK(fefu::half_growth_policy::grow(16) == 24);
+    CHECK(fefu::half_growth_policy::grow(1) == 2);
+
+    fefu::hash_map<int, int, hash<int>, equal_to<int>, fefu::allocator<pair<const int, int>>,
+        fefu::mask_index_policy, fefu::group_probing_policy, fefu::doubling_growth_policy> doubling(16);
+    for (int i = 0; i < 7; i++)
+        doubling[i] = i;
+    CHECK(doubling.bucket_count() == 32);
+
+    fefu::hash_map<int, int, hash<int>, equal_to<int>, fefu::allocator<pair<const int, int>>,
+        fefu::prime_index_policy, fefu::group_probing_policy, fefu::half_growth_policy> primes(11);
+    for (int i = 0; i < 5; i++)
+        primes[i] = i;
+    CHECK(primes.bucket_count() == 17);
+
+    fefu::hash_map<int, int> hmap;
+    CHECK(hmap.min_load_factor() == 0.0f);
+    CHECK_THROWS(hmap.min_load_factor(0.4f));
+    CHECK_THROWS(hmap.min_load_factor(-0.1f));
+    hmap.min_load_factor(0.1f);
+    CHECK_THROWS(hmap.max_load_factor(0.1f));
+    for (int i = 0; i < 1000; i++)
+        hmap[i] = i;
+    size_t grown = hmap.bucket_count();
+    for (int i = 0; i < 990; i++)
+        hmap.erase(i);
+    CHECK(hmap.bucket_count() < grown);
+    CHECK(hmap.load_factor() >= 0.1f);
+    CHECK(hmap.load_factor() <= 0.4f);
+    for (int i = 990; i < 1000; i++)
+        CHECK(hmap.at(i) == i);
+}
+
+TEST_CASE("shrinking", "[hash_map]") {
+    fefu::hash_map<int, int> hmap;
+    for (int i = 0; i < 1000; i++)
+        hmap[i] = i;
+    size_t grown = hmap.bucket_count();
+    for (int i = 0; i < 990; i++)
+        hmap.erase(i);
+    CHECK(hmap.bucket_count() == grown);
+    hmap.shrink_to_fit();
+    CHECK(hmap.bucket_count() == 32);
+    CHECK(hmap.at(995) == 995);
+    hmap.clear();
+    CHECK(hmap.bucket_count() == 32);
+    hmap.shrink_to_fit();
+    CHECK(hmap.bucket_count() == 0);
+
+    // right after growing the load is under the low mark, but alternating
+    // insertions and erasures at that boundary do not rehash
+    hmap.min_load_factor(0.1f);
+    int inserted = 0;
+    while (hmap.bucket_count() < 400)
+        hmap[inserted++] = 0;
+    size_t buckets = hmap.bucket_count();
+    CHECK(hmap.load_factor() < 0.1f);
+    for (int i = 0; i < 100; i++) {
+        hmap.erase(inserted - 1);
+        hmap[inserted - 1] = 0;
+    }
+    CHECK(hmap.bucket_count() == buckets);
+
+    while (hmap.bucket_count() == buckets)
+        hmap.erase(--inserted);
+    CHECK(hmap.bucket_count() < buckets);
+    CHECK(hmap.load_factor() <= 0.4f);
+    hmap.clear();
+    CHECK(hmap.bucket_count() == 0);
+
+    // tables sized up front for a burst shrink after it as well
+    vector<pair<int, int>> burst;
+    for (int i = 0; i < 100000; i++)
+        burst.emplace_back(i, i);
+    fefu::hash_map<int, int> reserved;
+    reserved.min_load_factor(0.1f);
+    reserved.reserve(burst.size());
+    fefu::hash_map<int, int> presized(burst.size() * 3);
+    presized.min_load_factor(0.1f);
+    fefu::hash_map<int, int> ranged;
+    ranged.min_load_factor(0.1f);
+    ranged.insert(burst.begin(), burst.end());
+    for (auto* sized : { &reserved, &presized, &ranged }) {
+        size_t buckets = sized->bucket_count();
+        for (const auto& el : burst)
+            (*sized)[el.first] = el.second;
+        CHECK(sized->bucket_count() == buckets);
+        for (int i = 10; i < 100000; i++)
+            sized->erase(i);
+        CHECK(sized->bucket_count() < 1024);
+        CHECK(sized->size() == 10);
+        CHECK(sized->at(9) == 9);
+    }
+}
+
+TEST_CASE("clear", "[hash_map]") {
+    auto shared = make_shared<int>(0);
+    fefu::hash_map<int, shared_ptr<int>> hmap;
+    for (int i = 0; i < 1000; i++)
+        hmap.emplace(i, shared);
+    for (int i = 0; i < 1000; i += 2)
+        hmap.erase(i);
+    size_t buckets = hmap.bucket_count();
+    hmap.clear();
+    CHECK(shared.use_count() == 1);
+    CHECK(hmap.empty());
+    CHECK(hmap.begin() == hmap.end());
+    CHECK(hmap.bucket_count() == buckets);
+    CHECK(hmap.load_factor() == 0.0f);
+    for (int i = 0; i < 1000; i++)
+        hmap.emplace(i, shared);
+    CHECK(hmap.bucket_count() == buckets);
+    CHECK(hmap.size() == 1000);
+    CHECK(hmap.count(999) == 1);
+}
+
+TEST_CASE("tombstone compaction", "[hash_map]") {
+    fefu::hash_map<int, string> hmap;
+    for (int i = 0; i < 100; i++)
+        hmap.emplace(i, to_string(i));
+    size_t buckets = hmap.bucket_count();
+    for (int i = 0; i < 100000; i++) {
+        hmap.erase(i);
+        hmap.emplace(i + 100, to_string(i + 100));
+    }
+    CHECK(hmap.load_factor() <= hmap.max_load_factor());
+    CHECK(hmap.bucket_count() == buckets);
+    CHECK(hmap.size() == 100);
+    for (int i = 100000; i < 100100; i++)
+        CHECK(hmap.at(i) == to_string(i));
+}
+
+TEST_CASE("tombstone compaction exception safety", "[hash_map]") {
+    fefu::hash_map<int, string, ThrowingHash> hmap;
+    for (int i = 0; i < 100; i++)
+        hmap.emplace(i, to_string(i));
+    size_t buckets = hmap.bucket_count();
+    int erased = 0;
+    bool thrown = false;
+    // compacting hashes every element, inserting one only a few
+    for (; erased < 100000 && !thrown; erased++) {
+        hmap.erase(erased);
+        ThrowingHash::budget = 50;
+        try {
+            hmap.emplace(erased + 100, to_string(erased + 100));
+        } catch (const runtime_error&) {
+            thrown = true;
+        }
+        ThrowingHash::budget = -1;
+    }
+    REQUIRE(thrown);
+    CHECK(hmap.bucket_count() == buckets);
+    CHECK(hmap.size() == 99);
+    CHECK(std::distance(hmap.begin(), hmap.end()) == 99);
+    for (int i = erased; i < erased + 99; i++)
+        CHECK(hmap.at(i) == to_string(i));
+}
+
+TEST_CASE("parallel rehash", "[hash_map]") {
+    int elements = 100000;
+    fefu::hash_map<string, int> strings;
+    fefu::hash_map<string, int, hash<string>, equal_to<string>, fefu::allocator<pair<const string, int>>,
+        fefu::prime_index_policy> primes;
+    fefu::hash_map<string, int, hash<string>, equal_to<string>, fefu::allocator<pair<const string, int>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> robinHood;
+    for (int i = 0; i < elements; i++) {
+        strings[to_string(i)] = i;
+        primes[to_string(i)] = i;
+        robinHood[to_string(i)] = i;
+    }
+    size_t buckets = strings.bucket_count();
+    strings.rehash(buckets * 2, 4);
+    CHECK(strings.bucket_count() >= buckets * 2);
+    strings.rehash(buckets * 4, 16);
+    CHECK(strings.bucket_count() >= buckets * 4);
+    // the last group of a prime table is partial
+    buckets = primes.bucket_count();
+    primes.rehash(buckets * 2, 3);
+    CHECK(primes.bucket_count() >= buckets * 2);
+    // Robin Hood probing rehashes on the calling thread
+    buckets = robinHood.bucket_count();
+    robinHood.rehash(buckets * 2, 4);
+    CHECK(robinHood.bucket_count() >= buckets * 2);
+
+    CHECK(strings.size() == static_cast<size_t>(elements));
+    CHECK(primes.size() == static_cast<size_t>(elements));
+    CHECK(robinHood.size() == static_cast<size_t>(elements));
+    for (int i = 0; i < elements; i++) {
+        CHECK(strings.at(to_string(i)) == i);
+        CHECK(primes.at(to_string(i)) == i);
+        CHECK(robinHood.at(to_string(i)) == i);
+    }
+    CHECK(!strings.contains("-1"));
+    CHECK(!primes.contains("-1"));
+    CHECK(strings.stats().tombstone_ratio == 0.0);
+
+    // a hash which may throw rehashes on the calling thread
+    fefu::hash_map<string, int, StringHash, equal_to<>> fallible;
+    for (int i = 0; i < elements; i++)
+        fallible[to_string(i)] = i;
+    buckets = fallible.bucket_count();
+    fallible.rehash(buckets * 2, 4);
+    CHECK(fallible.bucket_count() >= buckets * 2);
+    CHECK(fallible.size() == static_cast<size_t>(elements));
+    for (int i = 0; i < elements; i++)
+        CHECK(fallible.at(to_string(i)) == i);
+    // and keeps the table when the hash throws
+    fefu::hash_map<int, int, ThrowingHash> throwing;
+    for (int i = 0; i < elements; i++)
+        throwing[i] = i;
+    buckets = throwing.bucket_count();
+    ThrowingHash::budget = 1000;
+    CHECK_THROWS(throwing.rehash(buckets * 2));
+    ThrowingHash::budget = 1000;
+    CHECK_THROWS(throwing.rehash(buckets * 2, 4));
+    ThrowingHash::budget = -1;
+    CHECK(throwing.bucket_count() == buckets);
+    CHECK(throwing.size() == static_cast<size_t>(elements));
+    CHECK(std::distance(throwing.begin(), throwing.end()) == elements);
+    for (int i = 0; i < elements; i++)
+        CHECK(throwing.at(i) == i);
+
+    fefu::hash_map<int, int> small;
+    small[1] = 1;
+    small.rehash(64, 8);
+    CHECK(small.bucket_count() >= 64);
+    CHECK(small.at(1) == 1);
+}
+
+TEST_CASE("parallel insert_bulk", "[hash_map]") {
+    // every key twice, the second time with another value
+    vector<pair<string, int>> elements;
+    int keys = 100000;
+    for (int i = 0; i < keys * 2; i++)
+        elements.emplace_back(to_string(i % keys), i);
+
+    fefu::hash_map<string, int> strings;
+    strings.insert_bulk(elements.begin(), elements.end(), 4);
+    fefu::hash_map<string, int, hash<string>, equal_to<string>, fefu::allocator<pair<const string, int>>,
+        fefu::prime_index_policy> primes;
+    primes.insert_bulk(elements.begin(), elements.end(), 3);
+    fefu::hash_map<string, int, hash<string>, equal_to<string>, fefu::allocator<pair<const string, int>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> robinHood;
+    robinHood.insert_bulk(elements.begin(), elements.end(), 4);
+
+    // existing elements and tombstones of a full table
+    fefu::hash_map<string, int> filled;
+    filled.max_load_factor(0.8f);
+    for (int i = 0; i < keys; i += 2)
+        filled[to_string(i)] = i;
+    for (int i = keys; i < keys * 2; i++)
+        filled[to_string(i)] = i;
+    for (int i = keys; i < keys * 2; i++)
+        filled.erase(to_string(i));
+    size_t buckets = filled.bucket_count();
+    filled.insert_bulk(elements.begin(), elements.end(), 16);
+    CHECK(filled.bucket_count() == buckets);
+
+    CHECK(strings.size() == static_cast<size_t>(keys));
+    CHECK(primes.size() == static_cast<size_t>(keys));
+    CHECK(robinHood.size() == static_cast<size_t>(keys));
+    CHECK(filled.size() == static_cast<size_t>(keys));
+    CHECK(strings.load_factor() <= strings.max_load_factor());
+    CHECK(primes.load_factor() <= primes.max_load_factor());
+    CHECK(filled.load_factor() <= filled.max_load_factor());
+    for (int i = 0; i < keys; i++) {
+        CHECK(strings.at(to_string(i)) == i);
+        CHECK(primes.at(to_string(i)) == i);
+        CHECK(robinHood.at(to_string(i)) == i);
+        CHECK(filled.at(to_string(i)) == i);
+    }
+    CHECK(!strings.contains("-1"));
+    CHECK(!filled.contains(to_string(keys)));
+}
+
 TEST_CASE("load_factor", "[hash_map]") {
     fefu::hash_map<int, string> hmap(10);
     CHECK(hmap.load_factor() == 0.0);
@@ -456,6 +1256,29 @@ TEST_CASE("insert range", "[hash_map]") {
     CHECK(hmap2.at(3) == "test3");
 }
 
+TEST_CASE("insert_bulk", "[hash_map]") {
+    vector<pair<int, string>> inputRange;
+    for (int i = 0; i < 1000; i++)
+        inputRange.emplace_back(i % 700, to_string(i));
+
+    fefu::hash_map<int, string> hmap;
+    hmap[0] = "abaca";
+    hmap.insert_bulk(inputRange.begin(), inputRange.end());
+    CHECK(hmap.size() == 700);
+    CHECK(hmap.at(0) == "abaca");
+    CHECK(hmap.at(1) == "1");
+    CHECK(hmap.at(699) == "699");
+
+    // the table grew once, to fit the whole range
+    fefu::hash_map<int, string> reserved;
+    reserved.reserve(1001);
+    CHECK(hmap.bucket_count() == reserved.bucket_count());
+
+    fefu::hash_map<int, string> built(inputRange.begin(), inputRange.end());
+    CHECK(built.size() == 700);
+    CHECK(built.at(0) == "0");
+}
+
 TEST_CASE("insert_or_assign", "[hash_map]") {
     fefu::hash_map<int, string> hmap;
     hmap.insert(make_pair(0, "abaca"));
@@ -533,6 +1356,43 @@ TEST_CASE("emplace", "hash_map") {
     CHECK(hmap.at(1) == vec);
 }
 
+struct Heavy {
+    static int constructed;
+
+    explicit Heavy(int v) : value(v) { constructed++; }
+    Heavy(const Heavy& src) : value(src.value) { constructed++; }
+    Heavy(Heavy&& src) : value(src.value) { constructed++; }
+
+    int value;
+};
+
+int Heavy::constructed = 0;
+
+TEST_CASE("emplace in place", "[hash_map]") {
+    // no rehash moves the elements during the test
+    fefu::hash_map<int, Heavy> hmap(64);
+    Heavy::constructed = 0;
+    CHECK(hmap.emplace(1, 10).second);
+    CHECK(Heavy::constructed == 1);
+    CHECK(!hmap.emplace(1, 20).second);
+    CHECK(Heavy::constructed == 1);
+
+    CHECK(hmap.emplace(piecewise_construct, forward_as_tuple(2), forward_as_tuple(30)).second);
+    CHECK(Heavy::constructed == 2);
+    CHECK(!hmap.emplace(piecewise_construct, forward_as_tuple(2), forward_as_tuple(40)).second);
+    CHECK(Heavy::constructed == 2);
+
+    pair<int, Heavy> el(3, Heavy(50));
+    Heavy::constructed = 0;
+    CHECK(hmap.emplace(el).second);
+    CHECK(!hmap.emplace(std::move(el)).second);
+    CHECK(Heavy::constructed == 1);
+
+    CHECK(hmap.at(1).value == 10);
+    CHECK(hmap.at(2).value == 30);
+    CHECK(hmap.at(3).value == 50);
+}
+
 TEST_CASE("erase_if", "[hash_map]") {
     fefu::hash_map<int, string> hmap = { pair<int, string>(1, "aba"),
                                         pair<int, string>(2, "caba"),
@@ -600,6 +1460,398 @@ TEST_CASE("insert into deleted", "[hash_map]") {
     CHECK(hmap.size() >= 100);
 }
 
+struct CollidingHash {
+    size_t operator()(int k) const {
+        return k % 3;
+    }
+};
+
+TEST_CASE("group probing", "[hash_map]") {
+    fefu::hash_map<int, int, CollidingHash> hmap;
+    unordered_map<int, int> expected;
+    srand(7);
+    for (int i = 0; i < 5000; i++) {
+        int k = rand() % 300;
+        if (rand() % 3 == 0) {
+            CHECK(hmap.erase(k) == expected.erase(k));
+        } else {
+            hmap[k] = i;
+            expected[k] = i;
+        }
+    }
+
+    REQUIRE(hmap.size() == expected.size());
+    for (int k = 0; k < 300; k++) {
+        REQUIRE(hmap.contains(k) == (expected.count(k) == 1));
+        if (hmap.contains(k))
+            CHECK(hmap.at(k) == expected[k]);
+    }
+
+    size_t iterated = 0;
+    for (auto it = hmap.begin(); it != hmap.end(); ++it)
+        iterated++;
+    CHECK(iterated == expected.size());
+}
+
+TEST_CASE("robin hood probing", "[hash_map]") {
+    fefu::hash_map<int, int, CollidingHash, equal_to<int>, fefu::allocator<pair<const int, int>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> collided;
+    unordered_map<int, int> expected;
+    srand(11);
+    for (int i = 0; i < 5000; i++) {
+        int k = rand() % 400;
+        if (rand() % 3 == 0) {
+            CHECK(collided.erase(k) == expected.erase(k));
+        } else {
+            collided[k] = i;
+            expected[k] = i;
+        }
+    }
+    REQUIRE(collided.size() == expected.size());
+    for (int k = 0; k < 400; k++) {
+        REQUIRE(collided.contains(k) == (expected.count(k) == 1));
+        if (collided.contains(k))
+            CHECK(collided.at(k) == expected[k]);
+    }
+
+    fefu::hash_map<int, string, hash<int>, equal_to<int>, fefu::allocator<pair<const int, string>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> hmap(64);
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 20; i++)
+            hmap[round * 20 + i] = "session";
+        for (int i = 0; i < 20; i++)
+            CHECK(hmap.erase(round * 20 + i) == 1);
+    }
+    // no tombstones, so the table never had to grow
+    CHECK(hmap.bucket_count() == 64);
+    CHECK(hmap.load_factor() == 0.0f);
+
+    for (int i = 0; i < 30; i++)
+        hmap[i] = to_string(i);
+    hmap.erase_if([](const pair<const int, string>& tmp) { return tmp.first % 2 == 0; });
+    CHECK(hmap.size() == 15);
+    for (int i = 0; i < 30; i++)
+        CHECK(hmap.contains(i) == (i % 2 == 1));
+}
+
+// The home slot of key k is k / 100 in a table of 64 buckets.
+struct HomeHash {
+    size_t operator()(int k) const {
+        return k / 100;
+    }
+};
+
+TEST_CASE("robin hood erase while iterating", "[hash_map]") {
+    using RobinHoodMap = fefu::hash_map<int, int, HomeHash, equal_to<int>, fefu::allocator<pair<const int, int>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy>;
+    // a run from the last slot to slot 1
+    RobinHoodMap wrapped(64);
+    for (int i = 0; i < 3; i++)
+        wrapped[6300 + i] = i;
+    REQUIRE(wrapped.bucket_count() == 64);
+    map<int, int> calls;
+    wrapped.erase_if([&calls](const pair<const int, int>& tmp) {
+        calls[tmp.first]++;
+        return tmp.first == 6300;
+    });
+    CHECK(calls.size() == 3);
+    for (auto& call : calls)
+        CHECK(call.second == 1);
+    CHECK(wrapped.size() == 2);
+    CHECK(wrapped.at(6301) == 1);
+    CHECK(wrapped.at(6302) == 2);
+    wrapped[6300] = 0;
+    // erasing the last slot brings back the element of the first one
+    auto last = wrapped.begin();
+    while (std::next(last) != wrapped.end())
+        ++last;
+    CHECK(wrapped.erase(last) == wrapped.end());
+    CHECK(wrapped.size() == 2);
+
+    // a run from slot 61 to slot 1, erased before the wrap point
+    RobinHoodMap early(64);
+    for (int i = 0; i < 5; i++)
+        early[6100 + i] = i;
+    REQUIRE(early.bucket_count() == 64);
+    RobinHoodMap erasedIf = early;
+    calls.clear();
+    erasedIf.erase_if([&calls](const pair<const int, int>& tmp) {
+        calls[tmp.first]++;
+        return tmp.first == 6100 || tmp.first == 6101;
+    });
+    CHECK(calls.size() == 5);
+    for (auto& call : calls)
+        CHECK(call.second == 1);
+    CHECK(erasedIf.size() == 3);
+    for (int i = 2; i < 5; i++)
+        CHECK(erasedIf.at(6100 + i) == i);
+    RobinHoodMap manual = early;
+    size_t visited = 0;
+    for (auto it = manual.begin(); it != manual.end(); visited++) {
+        if (it->first == 6100)
+            it = manual.erase(it);
+        else
+            ++it;
+    }
+    CHECK(visited == 5);
+    CHECK(manual.size() == 4);
+    RobinHoodMap rangeErased = early;
+    auto first = rangeErased.begin();
+    while (first->first != 6100)
+        ++first;
+    CHECK(rangeErased.erase(first, rangeErased.end()) == rangeErased.end());
+    CHECK(rangeErased.size() == 2);
+
+    // the element of last moves back while the range is erased
+    RobinHoodMap ranged(64);
+    for (int i = 0; i < 3; i++)
+        ranged[300 + i] = i;
+    ranged[12000] = 3;
+    REQUIRE(ranged.bucket_count() == 64);
+    auto next = ranged.erase(ranged.begin(), std::next(ranged.begin(), 2));
+    REQUIRE(next != ranged.end());
+    CHECK(next->first == 302);
+    CHECK(ranged.size() == 2);
+    CHECK(ranged.at(302) == 2);
+    CHECK(ranged.at(12000) == 3);
+}
+
+// Throws when built from a negative value.
+struct Fallible {
+    Fallible(int v) : value(v) {
+        if (v < 0)
+            throw runtime_error("negative");
+    }
+
+    int value;
+};
+
+struct QuarterHash {
+    size_t operator()(int k) const {
+        return k % 4;
+    }
+};
+
+TEST_CASE("robin hood insert exception safety", "[hash_map]") {
+    fefu::hash_map<int, Fallible, QuarterHash, equal_to<int>, fefu::allocator<pair<const int, Fallible>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> hmap(64);
+    for (int i = 0; i < 12; i++)
+        hmap.try_emplace(i, i);
+    // every new key lands in the middle of the runs and shifts them
+    CHECK_THROWS(hmap.try_emplace(12, -1));
+    CHECK_THROWS(hmap.emplace(piecewise_construct, forward_as_tuple(13), forward_as_tuple(-1)));
+    CHECK_THROWS(hmap.insert_or_assign(14, -1));
+    CHECK(hmap.size() == 12);
+    for (int i = 0; i < 12; i++) {
+        REQUIRE(hmap.contains(i));
+        CHECK(hmap.at(i).value == i);
+    }
+    for (int i = 12; i < 15; i++)
+        CHECK(!hmap.contains(i));
+    size_t iterated = 0;
+    for (auto it = hmap.begin(); it != hmap.end(); ++it)
+        iterated++;
+    CHECK(iterated == 12);
+}
+
+TEST_CASE("stats()", "[hash_map]") {
+    fefu::hash_map<int, int> hmap;
+    CHECK(hmap.stats().present_probes.empty());
+    for (int i = 0; i < 1000; i++)
+        hmap[i] = i;
+    for (int i = 0; i < 1000; i += 4)
+        hmap.erase(i);
+    fefu::probe_stats stats = hmap.stats();
+    size_t present = 0, absent = 0, clustered = 0;
+    for (size_t count : stats.present_probes)
+        present += count;
+    for (size_t count : stats.absent_probes)
+        absent += count;
+    for (size_t i = 0; i < stats.cluster_sizes.size(); i++)
+        clustered += (i + 1) * stats.cluster_sizes[i];
+    CHECK(present == hmap.size());
+    // one per group
+    CHECK(absent > 0);
+    CHECK(absent <= hmap.bucket_count());
+    CHECK(clustered >= hmap.size());
+    CHECK(stats.average_displacement <= stats.max_displacement);
+    CHECK(stats.tombstone_ratio * hmap.bucket_count() <= 250);
+
+    fefu::hash_map<int, int, CollidingHash, equal_to<int>, fefu::allocator<pair<const int, int>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> collided;
+    for (int i = 0; i < 30; i++)
+        collided[i] = i;
+    stats = collided.stats();
+    present = 0;
+    absent = 0;
+    for (size_t count : stats.present_probes)
+        present += count;
+    for (size_t count : stats.absent_probes)
+        absent += count;
+    CHECK(present == collided.size());
+    // one per slot under Robin Hood probing
+    CHECK(absent == collided.bucket_count());
+    CHECK(stats.absent_probes.size() > 1);
+    // ten keys share each of the home slots 0, 1 and 2
+    CHECK(stats.max_displacement == 27);
+    CHECK(stats.present_probes.size() == 28);
+    CHECK(stats.cluster_sizes.back() == 1);
+    CHECK(stats.cluster_sizes.size() == 30);
+    CHECK(stats.tombstone_ratio == 0);
+
+#ifdef FEFU_HASH_MAP_PROBE_COUNTERS
+    collided.reset_counters();
+    CHECK(collided.contains(27));
+    CHECK(collided.counters().finds == 1);
+    CHECK(collided.counters().find_probes > 1);
+    CHECK(collided.counters().find_probes <= stats.present_probes.size());
+
+    // a lookup through both tables of an incremental rehash counts once
+    fefu::hash_map<int, int> growing(64);
+    growing.incremental_rehash(1);
+    int inserted = 0;
+    size_t buckets = growing.bucket_count();
+    while (buckets == growing.bucket_count())
+        growing[inserted++] = 0;
+    growing.reset_counters();
+    CHECK(growing.contains(0));
+    CHECK(!growing.contains(-1));
+    CHECK(growing.counters().finds == 2);
+    CHECK(growing.counters().find_probes >= 3);
+
+    // const lookups from several threads
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&growing, inserted] {
+            for (int k = 0; k < inserted; k++)
+                growing.contains(k);
+        });
+    }
+    for (auto& th : threads)
+        th.join();
+    CHECK(growing.counters().finds == 2 + 4 * static_cast<size_t>(inserted));
+#endif
+}
+
+TEST_CASE("incremental rehash", "[hash_map]") {
+    fefu::hash_map<int, int> hmap;
+    hmap.incremental_rehash(2);
+    CHECK(hmap.incremental_rehash() == 2);
+    unordered_map<int, int> expected;
+    srand(13);
+    for (int i = 0; i < 20000; i++) {
+        int k = rand() % 3000;
+        if (rand() % 4 == 0) {
+            CHECK(hmap.erase(k) == expected.erase(k));
+        } else {
+            hmap[k] = i;
+            expected[k] = i;
+        }
+    }
+    REQUIRE(hmap.size() == expected.size());
+    for (int k = 0; k < 3000; k++) {
+        REQUIRE(hmap.contains(k) == (expected.count(k) == 1));
+        if (hmap.contains(k))
+            CHECK(hmap.at(k) == expected[k]);
+    }
+
+    // a growth leaves most of the elements in the previous table
+    fefu::hash_map<int, int> growing(64);
+    growing.incremental_rehash(1);
+    int inserted = 0;
+    size_t buckets = growing.bucket_count();
+    while (buckets == growing.bucket_count() || inserted % 7 != 0)
+        growing[inserted++] = 0;
+    size_t iterated = 0;
+    for (auto it = growing.cbegin(); it != growing.cend(); ++it)
+        iterated++;
+    CHECK(iterated == growing.size());
+    for (int k = 0; k < inserted; k++)
+        REQUIRE(growing.find(k) != growing.end());
+
+    fefu::hash_map<int, int> copy(growing);
+    CHECK(copy == growing);
+    growing.erase_if([](const pair<const int, int>& tmp) { return tmp.first % 2 == 0; });
+    CHECK(growing.size() == static_cast<size_t>(inserted / 2));
+    for (int k = 0; k < inserted; k++)
+        CHECK(growing.contains(k) == (k % 2 == 1));
+    CHECK(copy.size() == static_cast<size_t>(inserted));
+
+    growing.incremental_rehash(0);
+    iterated = 0;
+    for (auto it = growing.begin(); it != growing.end(); ++it)
+        iterated++;
+    CHECK(iterated == growing.size());
+    copy.clear();
+    CHECK(copy.empty());
+    CHECK(copy.begin() == copy.end());
+
+    // a step too small for doubling tables is raised, so every migration is
+    // over before the next growth
+    using Alloc = fefu::counting_allocator<pair<const int, int>>;
+    fefu::allocation_counter counter;
+    fefu::hash_map<int, int, hash<int>, equal_to<int>, Alloc, fefu::mask_index_policy,
+        fefu::group_probing_policy, fefu::doubling_growth_policy> doubling{ Alloc(counter) };
+    doubling.incremental_rehash(1);
+    for (int i = 0; i < 100000; i++) {
+        buckets = doubling.bucket_count();
+        size_t tables = counter.allocations - counter.deallocations;
+        doubling[i] = i;
+        if (doubling.bucket_count() != buckets)
+            CHECK(tables <= 1);
+    }
+    CHECK(doubling.size() == 100000);
+    for (int i = 0; i < 100000; i++)
+        CHECK(doubling.at(i) == i);
+}
+
+TEST_CASE("incremental rehash with keys of the table", "[hash_map]") {
+    fefu::hash_map<string, int> hmap(64);
+    hmap.incremental_rehash(1);
+    int inserted = 0;
+    size_t buckets = hmap.bucket_count();
+    while (buckets == hmap.bucket_count())
+        hmap[to_string(inserted++)] = 0;
+    // the keys below live in the table being migrated
+    for (int i = 0; i < 20; i++) {
+        auto res = hmap.insert_or_assign(hmap.begin()->first, i);
+        CHECK(!res.second);
+        CHECK(res.first->second == i);
+        CHECK(hmap.at(res.first->first) == i);
+        int& value = hmap[hmap.begin()->first];
+        value = i + 1;
+        CHECK(hmap.at(hmap.begin()->first) == hmap.begin()->second);
+        CHECK(!hmap.emplace(*hmap.begin()).second);
+        CHECK(!hmap.try_emplace(hmap.begin()->first, i).second);
+        res = hmap.insert_or_assign(to_string(inserted), hmap.begin()->second);
+        CHECK(res.second);
+        CHECK(res.first->first == to_string(inserted++));
+    }
+    for (int i = 0; i < 10; i++)
+        CHECK(hmap.erase(hmap.begin()->first) == 1);
+    CHECK(hmap.size() == static_cast<size_t>(inserted - 10));
+
+    fefu::hash_map<string, int, hash<string>, equal_to<string>, fefu::allocator<pair<const string, int>>,
+        fefu::mask_index_policy, fefu::robin_hood_policy> robinHood(64);
+    robinHood.incremental_rehash(1);
+    inserted = 0;
+    buckets = robinHood.bucket_count();
+    while (buckets == robinHood.bucket_count())
+        robinHood[to_string(inserted++)] = 0;
+    for (int i = 0; i < 20; i++) {
+        string key = to_string(inserted++);
+        auto res = robinHood.emplace(key, i);
+        // the returned iterator follows the element through the migration
+        REQUIRE(res.second);
+        CHECK(res.first->first == key);
+        CHECK(robinHood[robinHood.begin()->first] == robinHood.begin()->second);
+        CHECK(robinHood.insert_or_assign(key, i + 1).first->second == i + 1);
+    }
+    CHECK(robinHood.size() == static_cast<size_t>(inserted));
+    for (int k = 0; k < inserted; k++)
+        CHECK(robinHood.contains(to_string(k)));
+}
+
 // ===========================================
 //              Exceptions
 // ===========================================
@@ -621,6 +1873,153 @@ TEST_CASE("exceptions", "[hash_map]") {
     CHECK_THROWS(hmap.erase(hmap.cend()));
 }
 
+TEST_CASE("concurrent_hash_map", "[concurrent_hash_map]") {
+    fefu::concurrent_hash_map<int, int> cmap(6);
+    CHECK(cmap.shard_count() == 8);
+    CHECK(cmap.try_emplace(1, 10));
+    CHECK_FALSE(cmap.try_emplace(1, 20));
+    CHECK_FALSE(cmap.insert_or_assign(1, 30));
+    int value = 0;
+    CHECK(cmap.find(1, value));
+    CHECK(value == 30);
+    CHECK_FALSE(cmap.find(2, value));
+    CHECK(cmap.visit(1, [](pair<const int, int>& el) { el.second++; }));
+    CHECK_FALSE(cmap.visit(2, [](pair<const int, int>&) {}));
+    CHECK(cmap.erase(1) == 1);
+    CHECK(cmap.empty());
+
+    // disjoint insertions and shared counters from several threads
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&cmap, t] {
+            for (int i = 0; i < 10000; i++) {
+                cmap.try_emplace(t * 10000 + i, i);
+                cmap.upsert(-1 - i % 10, [](int& count) { count++; }, 1);
+                int found;
+                cmap.find(t * 10000 + i / 2, found);
+            }
+        });
+    }
+    for (auto& th : threads)
+        th.join();
+    CHECK(cmap.size() == 40010);
+    int total = 0;
+    cmap.visit_all([&total](const pair<const int, int>& el) {
+        if (el.first < 0)
+            total += el.second;
+    });
+    CHECK(total == 40000);
+    CHECK(cmap.contains(39999));
+    cmap.clear();
+    CHECK(cmap.size() == 0);
+}
+
+struct Twin {
+    long long first, second;
+};
+
+TEST_CASE("seqlock_hash_map", "[concurrent_hash_map]") {
+    fefu::seqlock_hash_map<int, int> smap;
+    unordered_map<int, int> expected;
+    srand(21);
+    for (int i = 0; i < 20000; i++) {
+        int k = rand() % 3000;
+        if (rand() % 3 == 0) {
+            CHECK(smap.erase(k) == expected.erase(k));
+        } else {
+            CHECK(smap.insert_or_assign(k, i) == (expected.count(k) == 0));
+            expected[k] = i;
+        }
+    }
+    REQUIRE(smap.size() == expected.size());
+    for (int k = 0; k < 3000; k++) {
+        int value = -1;
+        REQUIRE(smap.find(k, value) == (expected.count(k) == 1));
+        if (expected.count(k) == 1)
+            CHECK(value == expected[k]);
+    }
+
+    // readers never see a value half written or a key in the wrong slot
+    fefu::seqlock_hash_map<int, Twin> twins;
+    atomic<bool> done{ false };
+    atomic<int> torn{ 0 };
+    vector<thread> readers;
+    for (int t = 0; t < 3; t++) {
+        readers.emplace_back([&] {
+            while (!done) {
+                for (int k = 0; k < 2000; k++) {
+                    Twin value;
+                    if (twins.find(k, value) && (value.first != value.second || value.first % 2000 != k))
+                        torn++;
+                }
+            }
+        });
+    }
+    for (long long i = 0; i < 100000; i++) {
+        int k = i % 2000;
+        if (i % 7 == 0)
+            twins.erase(k);
+        else
+            twins.insert_or_assign(k, Twin{ i, i });
+    }
+    done = true;
+    for (auto& th : readers)
+        th.join();
+    CHECK(torn == 0);
+}
+
+TEST_CASE("aggregate_hash_map", "[concurrent_hash_map]") {
+    fefu::aggregate_hash_map<int, long long> counts;
+    fefu::aggregate_hash_map<int, double> minimums, maximums;
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 20000; i++) {
+                counts.add(i % 5000, 1);
+                minimums.combine(i % 100, i * 4.0 + t, fefu::atomic_min());
+                maximums.combine(i % 100, i * 4.0 + t, fefu::atomic_max());
+            }
+        });
+    }
+    for (auto& th : threads)
+        th.join();
+
+    CHECK(counts.size() == 5000);
+    CHECK(counts.bucket_count() >= 10000);
+    long long total = 0;
+    counts.for_each([&total](int, long long count) {
+        CHECK(count == 16);
+        total += count;
+    });
+    CHECK(total == 80000);
+    double value;
+    CHECK(minimums.find(7, value));
+    CHECK(value == 28.0);
+    CHECK(maximums.find(7, value));
+    CHECK(value == 19907 * 4.0 + 3);
+    CHECK_FALSE(counts.contains(5000));
+
+    // more inserters than half the slots of the smallest table, all at once
+    fefu::aggregate_hash_map<int, int> crowded;
+    atomic<bool> start{ false };
+    threads.clear();
+    for (int t = 0; t < 32; t++) {
+        threads.emplace_back([&, t] {
+            while (!start.load())
+                this_thread::yield();
+            for (int i = 0; i < 100; i++)
+                crowded.add(t * 100 + i, 1);
+        });
+    }
+    start.store(true);
+    for (auto& th : threads)
+        th.join();
+    CHECK(crowded.size() == 3200);
+    CHECK(crowded.bucket_count() >= 2 * crowded.size());
+    for (int k = 0; k < 3200; k++)
+        CHECK(crowded.contains(k));
+}
+
 #define BENCHMARK
 #define STDTEST
 #ifdef BENCHMARK
@@ -629,8 +2028,14 @@ TEST_CASE("exceptions", "[hash_map]") {
 //              Benchmark
 // ===========================================
 
+// Bytes of table storage per element.
+template <typename Map>
+double bytes_per_element(const Map& hmap) {
+    return (double)hmap.memory_usage().total() / hmap.size();
+}
+
 void benchmark_t1(size_t rounds) {
-    printf("BENCHMARK: rounds: %d\n", rounds);
+    printf("BENCHMARK: rounds: %zu\n", rounds);
 
     // =============================
     //         operator[]
@@ -647,6 +2052,7 @@ void benchmark_t1(size_t rounds) {
     double time = ((double)clock() - start) / CLOCKS_PER_SEC;
 
     printf(" - operator[]: time taken: %.2fs\n", time);
+    printf(" - operator[]: memory per element: %.1f bytes\n", bytes_per_element(hmap));
 
     // =============================
     //         iterators
@@ -678,6 +2084,22 @@ void benchmark_t1(size_t rounds) {
     time = ((double)clock() - start) / CLOCKS_PER_SEC;
     printf(" - insert: time taken: %.2fs\n", time);
 
+    // =============================
+    //         insert_bulk
+    // =============================
+    vector<pair<int, float>> pairs;
+    for (size_t i = 0; i < rounds; i++) {
+        pairs.emplace_back(i, i);
+    }
+    fefu::hash_map<int, float>  hmap4;
+    start = clock();
+
+    hmap4.insert_bulk(pairs.begin(), pairs.end());
+    CHECK(hmap4.size() == rounds);
+
+    time = ((double)clock() - start) / CLOCKS_PER_SEC;
+    printf(" - insert_bulk: time taken: %.2fs\n", time);
+
     // =============================
     //         erase
     // =============================
@@ -710,20 +2132,39 @@ void benchmark_t1(size_t rounds) {
     // =============================
     //         find
     // =============================
+    // find and find_many look up the same keys, all of them present
+    vector<int> keys(rounds);
+    for (auto& key : keys) {
+        key = rand() % rounds;
+    }
+    size_t hits = 0;
     start = clock();
 
     for (size_t i = 0; i < rounds; i++) {
-        hmap.find(rand());
+        hits += hmap.find(keys[i]) != hmap.end();
     }
+    CHECK(hits == rounds);
 
     time = ((double)clock() - start) / CLOCKS_PER_SEC;
     printf(" - find: time taken: %.2fs\n", time);
 
+    // =============================
+    //         find_many
+    // =============================
+    vector<fefu::hash_map<int, int>::iterator> found(rounds);
+    start = clock();
+
+    hmap.find_many(keys.begin(), keys.end(), found.begin());
+
+    time = ((double)clock() - start) / CLOCKS_PER_SEC;
+    CHECK(count(found.begin(), found.end(), hmap.end()) == 0);
+    printf(" - find_many: time taken: %.2fs\n", time);
+
     printf("\n");
 }
 
 void benchmark_t2(size_t rounds) {
-    printf("BENCHMARK STD UNORDERED MAP: rounds: %d\n", rounds);
+    printf("BENCHMARK STD UNORDERED MAP: rounds: %zu\n", rounds);
 
     // =============================
     //         operator[]
@@ -841,4 +2282,258 @@ TEST_CASE("BENCHMARK3", "[Benchmark]") {
 #endif
 }
 
+template <typename IndexPolicy, typename GrowthPolicy>
+void benchmark_growth(const char* name, size_t rounds, float maxLoadFactor) {
+    fefu::hash_map<int, int, hash<int>, equal_to<int>, fefu::allocator<pair<const int, int>>,
+        IndexPolicy, fefu::group_probing_policy, GrowthPolicy> hmap;
+    hmap.max_load_factor(maxLoadFactor);
+    clock_t start = clock();
+
+    for (size_t i = 0; i < rounds; i++) {
+        hmap[i] = i;
+    }
+    CHECK(hmap.size() == rounds);
+
+    double time = ((double)clock() - start) / CLOCKS_PER_SEC;
+    printf(" - %s, max load %.1f: time taken: %.2fs, memory per element: %.1f bytes\n",
+        name, maxLoadFactor, time, bytes_per_element(hmap));
+}
+
+TEST_CASE("BENCHMARK growth policies", "[Benchmark]") {
+    size_t rounds = 1000000;
+    printf("BENCHMARK GROWTH POLICIES: rounds: %zu\n", rounds);
+    benchmark_growth<fefu::mask_index_policy, fefu::default_growth_policy>("x6", rounds, 0.4f);
+    benchmark_growth<fefu::mask_index_policy, fefu::doubling_growth_policy>("x2", rounds, 0.4f);
+    benchmark_growth<fefu::mask_index_policy, fefu::doubling_growth_policy>("x2", rounds, 0.8f);
+    benchmark_growth<fefu::prime_index_policy, fefu::half_growth_policy>("x1.5 primes", rounds, 0.8f);
+    printf("\n");
+}
+
+// Slowest single operator[] call, which is the one paying for a rehash.
+double max_insert_latency(size_t rounds, size_t incrementalStep) {
+    fefu::hash_map<int, int> hmap;
+    hmap.incremental_rehash(incrementalStep);
+    double worst = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        auto start = chrono::steady_clock::now();
+        hmap[i] = i;
+        chrono::duration<double, milli> time = chrono::steady_clock::now() - start;
+        worst = max(worst, time.count());
+    }
+    CHECK(hmap.size() == rounds);
+    return worst;
+}
+
+TEST_CASE("BENCHMARK incremental rehash", "[Benchmark]") {
+    size_t rounds = 1000000;
+    printf("BENCHMARK INSERT LATENCY: rounds: %zu\n", rounds);
+    printf(" - rehash at once: max insert: %.3fms\n", max_insert_latency(rounds, 0));
+    printf(" - incremental rehash: max insert: %.3fms\n", max_insert_latency(rounds, 8));
+    printf("\n");
+}
+
+// Builds many short-lived maps, like a scratch map per request.
+template <template <typename> class A>
+void benchmark_allocator(const char* name, size_t maps, size_t elements, A<pair<const int, int>> alloc,
+    fefu::arena* arena = nullptr) {
+    clock_t start = clock();
+    for (size_t i = 0; i < maps; i++) {
+        {
+            fefu::hash_map<int, int, hash<int>, equal_to<int>, A<pair<const int, int>>> hmap{ alloc };
+            for (size_t j = 0; j < elements; j++)
+                hmap[j] = j;
+            CHECK(hmap.size() == elements);
+        }
+        if (arena != nullptr)
+            arena->release();
+    }
+    double time = ((double)clock() - start) / CLOCKS_PER_SEC;
+    printf(" - %s: time taken: %.2fs\n", name, time);
+}
+
+TEST_CASE("BENCHMARK allocators", "[Benchmark]") {
+    size_t maps = 100000, elements = 100;
+    printf("BENCHMARK ALLOCATORS: maps: %zu, elements: %zu\n", maps, elements);
+    fefu::arena arena;
+    fefu::pool pool;
+    benchmark_allocator<fefu::allocator>("fefu::allocator", maps, elements, {});
+    benchmark_allocator<fefu::arena_allocator>("arena", maps, elements,
+        fefu::arena_allocator<pair<const int, int>>(arena), &arena);
+    benchmark_allocator<fefu::pool_allocator>("pool", maps, elements, fefu::pool_allocator<pair<const int, int>>(pool));
+    benchmark_allocator<fefu::pmr_allocator>("pmr default resource", maps, elements, {});
+    printf("\n");
+}
+
+template <template <typename> class A>
+void benchmark_random_find(const char* name, size_t rounds) {
+    fefu::hash_map<int, int, hash<int>, equal_to<int>, A<pair<const int, int>>> hmap;
+    hmap.max_load_factor(0.8f);
+    hmap.reserve(rounds);
+    for (size_t i = 0; i < rounds; i++)
+        hmap[i] = i;
+
+    mt19937 gen(42);
+    uniform_int_distribution<int> keys(0, rounds * 2);
+    size_t found = 0;
+    clock_t start = clock();
+    for (size_t i = 0; i < 10000000; i++)
+        found += hmap.contains(keys(gen));
+    double time = ((double)clock() - start) / CLOCKS_PER_SEC;
+    CHECK(found > 0);
+    printf(" - %s: 10M random finds: %.2fs\n", name, time);
+}
+
+// Needs over 2GB of memory, run it explicitly.
+TEST_CASE("BENCHMARK huge pages", "[.][Benchmark]") {
+    size_t rounds = 100000000;
+    printf("BENCHMARK HUGE PAGES: rounds: %zu\n", rounds);
+    benchmark_random_find<fefu::allocator>("fefu::allocator", rounds);
+    benchmark_random_find<fefu::huge_page_allocator>("huge_page_allocator", rounds);
+    printf("\n");
+}
+
+template <typename K>
+double benchmark_parallel_rehash(size_t rounds, size_t threads, K (*key)(size_t)) {
+    fefu::hash_map<K, int> hmap;
+    hmap.reserve(rounds);
+    for (size_t i = 0; i < rounds; i++)
+        hmap[key(i)] = i;
+    auto start = chrono::steady_clock::now();
+    hmap.rehash(hmap.bucket_count() * 2, threads);
+    chrono::duration<double> time = chrono::steady_clock::now() - start;
+    CHECK(hmap.size() == rounds);
+    return time.count();
+}
+
+TEST_CASE("BENCHMARK parallel rehash", "[Benchmark]") {
+    size_t rounds = 4000000;
+    printf("BENCHMARK PARALLEL REHASH: rounds: %zu, hardware threads: %u\n",
+        rounds, thread::hardware_concurrency());
+    for (size_t threads : { 1, 4, 16 }) {
+        printf(" - %zu threads: int keys: %.3fs, string keys: %.3fs\n", threads,
+            benchmark_parallel_rehash<int>(rounds, threads, [](size_t i) { return static_cast<int>(i); }),
+            benchmark_parallel_rehash<string>(rounds / 4, threads, [](size_t i) { return to_string(i); }));
+    }
+    printf("\n");
+}
+
+template <typename K>
+void benchmark_parallel_insert(size_t rounds, K (*key)(size_t)) {
+    vector<pair<K, int>> elements;
+    for (size_t i = 0; i < rounds; i++)
+        elements.emplace_back(key(i), i);
+    auto start = chrono::steady_clock::now();
+    fefu::hash_map<K, int> ranged(elements.begin(), elements.end(), rounds);
+    chrono::duration<double> time = chrono::steady_clock::now() - start;
+    CHECK(ranged.size() == rounds);
+    printf(" - range constructor: %.3fs\n", time.count());
+    for (size_t threads : { 1, 4, 16 }) {
+        start = chrono::steady_clock::now();
+        fefu::hash_map<K, int> hmap(rounds);
+        hmap.insert_bulk(elements.begin(), elements.end(), threads);
+        time = chrono::steady_clock::now() - start;
+        CHECK(hmap.size() == rounds);
+        printf(" - insert_bulk, %zu threads: %.3fs\n", threads, time.count());
+    }
+}
+
+TEST_CASE("BENCHMARK parallel insert_bulk", "[Benchmark]") {
+    size_t rounds = 4000000;
+    printf("BENCHMARK PARALLEL INSERT BULK: hardware threads: %u\n", thread::hardware_concurrency());
+    printf("int keys, rounds: %zu\n", rounds);
+    benchmark_parallel_insert<int>(rounds, [](size_t i) { return static_cast<int>(i); });
+    printf("string keys, rounds: %zu\n", rounds / 4);
+    benchmark_parallel_insert<string>(rounds / 4, [](size_t i) { return to_string(i); });
+    printf("\n");
+}
+
+// Wall clock time of threads sharing rounds of mixed operations, most of
+// them lookups.
+template <typename Map, typename Lock>
+double benchmark_threads(Map& hmap, Lock& lock, size_t threadCount, size_t rounds) {
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (size_t t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t] {
+            size_t first = t * (rounds / threadCount), last = first + rounds / threadCount;
+            for (size_t i = first; i < last; i++) {
+                int k = i;
+                if (i % 4 == 0) {
+                    lock([&] { hmap.insert_or_assign(k, k); });
+                } else {
+                    lock([&] { hmap.contains(k / 2); });
+                }
+            }
+        });
+    }
+    for (auto& th : threads)
+        th.join();
+    chrono::duration<double> time = chrono::steady_clock::now() - start;
+    return time.count();
+}
+
+TEST_CASE("BENCHMARK concurrent_hash_map", "[Benchmark]") {
+    size_t rounds = 4000000;
+    printf("BENCHMARK CONCURRENT HASH MAP: rounds: %zu, hardware threads: %u\n",
+        rounds, thread::hardware_concurrency());
+    for (size_t threads = 1; threads <= 64; threads *= 2) {
+        fefu::hash_map<int, int> hmap;
+        mutex globalMutex;
+        auto global = [&globalMutex](auto&& op) {
+            lock_guard<mutex> guard(globalMutex);
+            op();
+        };
+        fefu::concurrent_hash_map<int, int> cmap;
+        auto unlocked = [](auto&& op) { op(); };
+        double locked = benchmark_threads(hmap, global, threads, rounds);
+        double sharded = benchmark_threads(cmap, unlocked, threads, rounds);
+        printf(" - %zu threads: global mutex: %.2fs, sharded: %.2fs\n", threads, locked, sharded);
+    }
+    printf("\n");
+}
+
+// Counts keys from every thread into one aggregate_hash_map, or into maps
+// of their own which are summed up afterwards.
+double benchmark_aggregation(size_t threadCount, size_t rounds, size_t keys, bool shared) {
+    auto start = chrono::steady_clock::now();
+    fefu::aggregate_hash_map<int, long long> aggregate;
+    vector<fefu::hash_map<int, long long>> local(threadCount);
+    vector<thread> threads;
+    for (size_t t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t] {
+            for (size_t i = t; i < rounds; i += threadCount) {
+                int k = (i * 2654435761u) % keys;
+                if (shared)
+                    aggregate.add(k, 1);
+                else
+                    local[t][k]++;
+            }
+        });
+    }
+    for (auto& th : threads)
+        th.join();
+    if (!shared) {
+        fefu::hash_map<int, long long> total;
+        for (auto& hmap : local) {
+            for (auto& el : hmap)
+                total[el.first] += el.second;
+        }
+        CHECK(total.size() == keys);
+    } else {
+        CHECK(aggregate.size() == keys);
+    }
+    chrono::duration<double> time = chrono::steady_clock::now() - start;
+    return time.count();
+}
+
+TEST_CASE("BENCHMARK aggregation", "[Benchmark]") {
+    size_t rounds = 10000000, keys = 1000000;
+    printf("BENCHMARK AGGREGATION: rounds: %zu, keys: %zu\n", rounds, keys);
+    for (size_t threads : { 1, 4, 16 }) {
+        printf(" - %zu threads: per-thread maps: %.2fs, aggregate_hash_map: %.2fs\n", threads,
+            benchmark_aggregation(threads, rounds, keys, false), benchmark_aggregation(threads, rounds, keys, true));
+    }
+    printf("\n");
+}
+
 #endif // BENCHMARK
\ No newline at end of file
@@ -0,0 +1,968 @@
+#pragma once
+
+#include "hash_map.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+namespace fefu
+{
+    // Counts the threads inside some operation, striped by thread so that
+    // entering one does not bounce a shared cache line between cores. Every
+    // stripe has Kinds counters, e.g. one per epoch parity.
+    template <std::size_t Kinds>
+    class ThreadStripes {
+    public:
+        static constexpr std::size_t stripes = 64;
+
+        // The counter of the calling thread for the given kind.
+        std::atomic<std::size_t>& local(std::size_t kind) {
+            return mStripes[threadStripe()].count[kind];
+        }
+
+        // Waits until every stripe was seen without a thread of the kind.
+        void waitIdle(std::size_t kind) const {
+            for (std::size_t i = 0; i < stripes; i++) {
+                while (mStripes[i].count[kind].load() != 0)
+                    std::this_thread::yield();
+            }
+        }
+
+    private:
+        struct alignas(64) Stripe {
+            std::atomic<std::size_t> count[Kinds] = {};
+        };
+
+        static std::size_t threadStripe() {
+            static std::atomic<std::size_t> next{ 0 };
+            thread_local std::size_t stripe = next.fetch_add(1, std::memory_order_relaxed) % stripes;
+            return stripe;
+        }
+
+        Stripe mStripes[stripes];
+    };
+
+    /*
+    *  A hash map safe to use from many threads at once. The keys are split
+    *  across a power of two number of hash_map shards by the upper bits of
+    *  their mixed hash, and every shard has its own reader-writer lock, so
+    *  threads working on different shards never wait for each other.
+    *
+    *  No iterator or reference to an element ever leaves a lock: lookups copy
+    *  the mapped value out, and code that needs the element itself runs as a
+    *  visitor while the shard is locked. Visitors must not call back into the
+    *  same %concurrent_hash_map.
+    */
+    template<typename K, typename T,
+        typename Hash = std::hash<K>,
+        typename Pred = std::equal_to<K>,
+        typename Alloc = allocator<std::pair<const K, T>>>
+    class concurrent_hash_map {
+    public:
+        using map_type = hash_map<K, T, Hash, Pred, Alloc>;
+        using key_type = K;
+        using mapped_type = T;
+        using hasher = Hash;
+        using key_equal = Pred;
+        using allocator_type = Alloc;
+        using value_type = std::pair<const key_type, mapped_type>;
+        using size_type = std::size_t;
+
+        /**
+         *  @brief  Creates an empty %concurrent_hash_map.
+         *  @param  shards  Number of shards, rounded up to a power of two.
+         *  @param  a       Allocator of every shard.
+         */
+        explicit concurrent_hash_map(size_type shards = default_shards(), const allocator_type& a = allocator_type()) {
+            size_type count = mask_index_policy::round_bucket_count(std::max<size_type>(shards, 1));
+            while ((size_type(1) << mShardBits) < count)
+                mShardBits++;
+            mShards.reset(new Shard[count]);
+            for (size_type i = 0; i < count; i++)
+                mShards[i].map = map_type(a);
+        }
+
+        concurrent_hash_map(const concurrent_hash_map&) = delete;
+        concurrent_hash_map& operator=(const concurrent_hash_map&) = delete;
+
+        /// Four shards per hardware thread, so few threads meet on a lock.
+        static size_type default_shards() {
+            return std::max(std::thread::hardware_concurrency(), 1u) * 4;
+        }
+
+        size_type shard_count() const noexcept {
+            return size_type(1) << mShardBits;
+        }
+
+        /// Returns the number of elements, which other threads may change.
+        size_type size() const {
+            size_type count = 0;
+            for (size_type i = 0; i < shard_count(); i++) {
+                std::shared_lock<std::shared_mutex> lock(mShards[i].mutex);
+                count += mShards[i].map.size();
+            }
+            return count;
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        /**
+         *  @brief  Copies the mapped value of a key.
+         *  @param  k    Key to look up.
+         *  @param  out  Receives a copy of the mapped value if @a k is found.
+         *  @return  Whether @a k was found.
+         */
+        bool find(const key_type& k, mapped_type& out) const {
+            size_type hash = mHash(k);
+            const Shard& shard = shardOf(hash);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.map.find_with_hash(k, hash);
+            if (it == shard.map.cend())
+                return false;
+            out = it->second;
+            return true;
+        }
+
+        bool contains(const key_type& k) const {
+            size_type hash = mHash(k);
+            const Shard& shard = shardOf(hash);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            return shard.map.contains_with_hash(k, hash);
+        }
+
+        /**
+         *  @brief  Inserts a (key, value) pair unless the key is present.
+         *  @return  Whether the pair was inserted.
+         */
+        template <typename... _Args>
+        bool try_emplace(const key_type& k, _Args&&... args) {
+            size_type hash = mHash(k);
+            Shard& shard = shardOf(hash);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            return shard.map.try_emplace_with_hash(k, hash, std::forward<_Args>(args)...).second;
+        }
+
+        bool insert(const value_type& x) {
+            return try_emplace(x.first, x.second);
+        }
+
+        /**
+         *  @brief  Inserts a (key, value) pair or assigns the value to the
+         *          element of the key.
+         *  @return  Whether the pair was inserted.
+         */
+        template <typename _Obj>
+        bool insert_or_assign(const key_type& k, _Obj&& obj) {
+            size_type hash = mHash(k);
+            Shard& shard = shardOf(hash);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            auto res = shard.map.try_emplace_with_hash(k, hash, std::forward<_Obj>(obj));
+            if (!res.second)
+                res.first->second = std::forward<_Obj>(obj);
+            return res.second;
+        }
+
+        /**
+         *  @brief  Updates the element of a key or inserts a new one.
+         *  @param  k       Key of the element.
+         *  @param  update  Called with the mapped value if @a k is present.
+         *  @param  args    Arguments building the mapped value otherwise.
+         *  @return  Whether a new element was inserted.
+         *
+         *  The lookup and the update or insertion are one atomic step.
+         */
+        template <typename _F, typename... _Args>
+        bool upsert(const key_type& k, _F&& update, _Args&&... args) {
+            size_type hash = mHash(k);
+            Shard& shard = shardOf(hash);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.map.find_with_hash(k, hash);
+            if (it != shard.map.end()) {
+                update(it->second);
+                return false;
+            }
+            shard.map.try_emplace_with_hash(k, hash, std::forward<_Args>(args)...);
+            return true;
+        }
+
+        size_type erase(const key_type& k) {
+            size_type hash = mHash(k);
+            Shard& shard = shardOf(hash);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            return shard.map.erase_with_hash(k, hash);
+        }
+
+        /**
+         *  @brief  Calls a function with the element of a key while its
+         *          shard is locked for writing.
+         *  @return  Whether @a k was found.
+         */
+        template <typename _F>
+        bool visit(const key_type& k, _F&& f) {
+            size_type hash = mHash(k);
+            Shard& shard = shardOf(hash);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.map.find_with_hash(k, hash);
+            if (it == shard.map.end())
+                return false;
+            f(*it);
+            return true;
+        }
+
+        // read-only overload, which only takes the shard's lock for reading
+        template <typename _F>
+        bool visit(const key_type& k, _F&& f) const {
+            size_type hash = mHash(k);
+            const Shard& shard = shardOf(hash);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.map.find_with_hash(k, hash);
+            if (it == shard.map.cend())
+                return false;
+            f(*it);
+            return true;
+        }
+
+        /// Calls a function with every element, locking a shard at a time.
+        template <typename _F>
+        void visit_all(_F&& f) {
+            for (size_type i = 0; i < shard_count(); i++) {
+                std::unique_lock<std::shared_mutex> lock(mShards[i].mutex);
+                for (auto& el : mShards[i].map)
+                    f(el);
+            }
+        }
+
+        template <typename _F>
+        void visit_all(_F&& f) const {
+            for (size_type i = 0; i < shard_count(); i++) {
+                std::shared_lock<std::shared_mutex> lock(mShards[i].mutex);
+                for (auto it = mShards[i].map.cbegin(); it != mShards[i].map.cend(); ++it)
+                    f(*it);
+            }
+        }
+
+        void clear() {
+            for (size_type i = 0; i < shard_count(); i++) {
+                std::unique_lock<std::shared_mutex> lock(mShards[i].mutex);
+                mShards[i].map.clear();
+            }
+        }
+
+        /// Prepares every shard for its share of @a n elements.
+        void reserve(size_type n) {
+            for (size_type i = 0; i < shard_count(); i++) {
+                std::unique_lock<std::shared_mutex> lock(mShards[i].mutex);
+                mShards[i].map.reserve(n / shard_count() + 1);
+            }
+        }
+
+    private:
+        // Own cache lines keep threads locking neighbouring shards from
+        // invalidating each other's.
+        struct alignas(64) Shard {
+            mutable std::shared_mutex mutex;
+            map_type map;
+        };
+
+        // The upper bits of another multiplication than hashMix(), so the
+        // shard does not fix the fingerprint or the home slot of a key.
+        size_type shardIndex(size_type hash) const {
+            if (mShardBits == 0)
+                return 0;
+            return static_cast<size_type>(hash * 0x9E3779B97F4A7C15ull) >> (sizeof(size_type) * CHAR_BIT - mShardBits);
+        }
+
+        Shard& shardOf(size_type hash) {
+            return mShards[shardIndex(hash)];
+        }
+
+        const Shard& shardOf(size_type hash) const {
+            return mShards[shardIndex(hash)];
+        }
+
+        Hash mHash;
+        std::unique_ptr<Shard[]> mShards;
+        size_type mShardBits = 0;
+    };
+
+    /*
+    *  A read-mostly hash map whose lookups take no lock. Writers are
+    *  serialized by a mutex and bump the version of every group of slots
+    *  they change to odd and back to even (a seqlock), readers copy what
+    *  they probe and retry if the version of a group it came from changed.
+    *
+    *  Growing publishes a new table through an atomic pointer. The previous
+    *  one is freed once every reader which may still probe it has left,
+    *  which readers announce in per-thread striped counters of the two
+    *  latest epochs.
+    *
+    *  Since readers may copy a slot while it is being written, keys and
+    *  mapped values must be trivially copyable. Lookups are linear probing
+    *  over the slots, erasure leaves tombstones until the next rebuild.
+    */
+    template<typename K, typename T,
+        typename Hash = std::hash<K>,
+        typename Pred = std::equal_to<K>>
+    class seqlock_hash_map {
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<T>::value,
+            "seqlock_hash_map copies keys and values while they may change");
+
+    public:
+        using key_type = K;
+        using mapped_type = T;
+        using hasher = Hash;
+        using key_equal = Pred;
+        using size_type = std::size_t;
+
+        /**
+         *  @brief  Creates an empty %seqlock_hash_map.
+         *  @param n  Minimal initial number of buckets.
+         */
+        explicit seqlock_hash_map(size_type n = 0) : mTable(new Table(std::max(n, Group::width))) {}
+
+        seqlock_hash_map(const seqlock_hash_map&) = delete;
+        seqlock_hash_map& operator=(const seqlock_hash_map&) = delete;
+
+        /// No reader or writer may be running.
+        ~seqlock_hash_map() {
+            delete mTable.load(std::memory_order_relaxed);
+        }
+
+        size_type size() const noexcept {
+            return mCount.load(std::memory_order_relaxed);
+        }
+
+        bool empty() const noexcept {
+            return size() == 0;
+        }
+
+        size_type bucket_count() const {
+            ReadGuard guard(*this);
+            return mTable.load()->capacity;
+        }
+
+        /**
+         *  @brief  Copies the mapped value of a key without locking.
+         *  @param  k    Key to look up.
+         *  @param  out  Receives the mapped value if @a k is found.
+         *  @return  Whether @a k was found.
+         */
+        bool find(const key_type& k, mapped_type& out) const {
+            ReadGuard guard(*this);
+            const Table* table = mTable.load();
+            size_type hash = mHash(k);
+            ctrl_t h2 = hashFragment(hashMix(hash));
+            while (true) {
+                size_type indx = table->home(hash);
+                size_type group = indx / Group::width;
+                uint32_t version = table->readBegin(group);
+                bool consistent = true;
+                for (size_type probes = 0; consistent && probes < table->capacity; probes++) {
+                    ctrl_t c = table->ctrl[indx].load(std::memory_order_relaxed);
+                    if (c == EMPTY) {
+                        if (table->readValidate(group, version))
+                            return false;
+                        break;
+                    }
+                    if (c == h2 && mKeyEqual(table->template load<key_type>(indx, 0), k)) {
+                        mapped_type value = table->template load<mapped_type>(indx, keyWords);
+                        if (!table->readValidate(group, version))
+                            break;
+                        out = value;
+                        return true;
+                    }
+                    indx = indx + 1 == table->capacity ? 0 : indx + 1;
+                    if (indx / Group::width != group) {
+                        consistent = table->readValidate(group, version);
+                        group = indx / Group::width;
+                        version = table->readBegin(group);
+                    }
+                }
+                if (consistent && table->readValidate(group, version))
+                    return false;
+            }
+        }
+
+        bool contains(const key_type& k) const {
+            mapped_type value;
+            return find(k, value);
+        }
+
+        /**
+         *  @brief  Inserts a (key, value) pair or assigns the value to the
+         *          element of the key.
+         *  @return  Whether the pair was inserted.
+         */
+        bool insert_or_assign(const key_type& k, const mapped_type& obj) {
+            std::lock_guard<std::mutex> lock(mWriter);
+            Table* table = mTable.load(std::memory_order_relaxed);
+            size_type hash = mHash(k);
+            size_type indx = findIndex(*table, k, hash);
+            if (indx != table->capacity) {
+                table->writeBegin(indx / Group::width);
+                table->store(indx, keyWords, obj);
+                table->writeEnd(indx / Group::width);
+                return false;
+            }
+            if (mCount.load(std::memory_order_relaxed) + mDeleted + 1 > maxLoadFactor * table->capacity)
+                table = rebuild(*table);
+            place(*table, hash, k, obj);
+            mCount.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        size_type erase(const key_type& k) {
+            std::lock_guard<std::mutex> lock(mWriter);
+            Table* table = mTable.load(std::memory_order_relaxed);
+            size_type indx = findIndex(*table, k, mHash(k));
+            if (indx == table->capacity)
+                return 0;
+            table->writeBegin(indx / Group::width);
+            table->ctrl[indx].store(DELETED, std::memory_order_relaxed);
+            table->writeEnd(indx / Group::width);
+            mDeleted++;
+            mCount.fetch_sub(1, std::memory_order_relaxed);
+            return 1;
+        }
+
+    private:
+        using word = std::uintptr_t;
+
+        static constexpr size_type keyWords = (sizeof(key_type) + sizeof(word) - 1) / sizeof(word);
+        static constexpr size_type slotWords = keyWords + (sizeof(mapped_type) + sizeof(word) - 1) / sizeof(word);
+        static constexpr float maxLoadFactor = 0.5f;
+
+        struct Table {
+            explicit Table(size_type n) :
+                capacity(mask_index_policy::round_bucket_count(n)),
+                ctrl(new std::atomic<ctrl_t>[capacity]),
+                words(new std::atomic<word>[capacity * slotWords]),
+                versions(new std::atomic<uint32_t>[(capacity + Group::width - 1) / Group::width]) {
+                index.reset(capacity);
+                for (size_type i = 0; i < capacity; i++)
+                    ctrl[i].store(EMPTY, std::memory_order_relaxed);
+                for (size_type i = 0; i < (capacity + Group::width - 1) / Group::width; i++)
+                    versions[i].store(0, std::memory_order_relaxed);
+            }
+
+            size_type home(size_type hash) const {
+                return index.index(hash);
+            }
+
+            uint32_t readBegin(size_type group) const {
+                uint32_t version;
+                while ((version = versions[group].load(std::memory_order_acquire)) & 1)
+                    std::this_thread::yield();
+                return version;
+            }
+
+            bool readValidate(size_type group, uint32_t version) const {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return versions[group].load(std::memory_order_relaxed) == version;
+            }
+
+            void writeBegin(size_type group) {
+                versions[group].store(versions[group].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+            }
+
+            void writeEnd(size_type group) {
+                versions[group].store(versions[group].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+
+            // Copies a value out of the words of a slot starting at offset.
+            template <typename V>
+            V load(size_type indx, size_type offset) const {
+                word buffer[(sizeof(V) + sizeof(word) - 1) / sizeof(word)];
+                const std::atomic<word>* src = words.get() + indx * slotWords + offset;
+                for (size_type i = 0; i < sizeof(buffer) / sizeof(word); i++)
+                    buffer[i] = src[i].load(std::memory_order_relaxed);
+                typename std::aligned_storage<sizeof(V), alignof(V)>::type value;
+                std::memcpy(&value, buffer, sizeof(V));
+                return *reinterpret_cast<V*>(&value);
+            }
+
+            template <typename V>
+            void store(size_type indx, size_type offset, const V& value) {
+                word buffer[(sizeof(V) + sizeof(word) - 1) / sizeof(word)] = {};
+                std::memcpy(buffer, &value, sizeof(V));
+                std::atomic<word>* dst = words.get() + indx * slotWords + offset;
+                for (size_type i = 0; i < sizeof(buffer) / sizeof(word); i++)
+                    dst[i].store(buffer[i], std::memory_order_relaxed);
+            }
+
+            size_type capacity;
+            fibonacci_index_policy index;
+            std::unique_ptr<std::atomic<ctrl_t>[]> ctrl;
+            std::unique_ptr<std::atomic<word>[]> words;
+            std::unique_ptr<std::atomic<uint32_t>[]> versions;
+        };
+
+        // Counts the reader in the current epoch for as long as it lives.
+        class ReadGuard {
+        public:
+            explicit ReadGuard(const seqlock_hash_map& map) : mReaders(map.mReaders) {
+                while (true) {
+                    mParity = map.mEpoch.load() & 1;
+                    mReaders.local(mParity).fetch_add(1);
+                    // a table loaded from now on is not retired in this epoch
+                    if ((map.mEpoch.load() & 1) == mParity)
+                        break;
+                    mReaders.local(mParity).fetch_sub(1);
+                }
+            }
+
+            ~ReadGuard() {
+                mReaders.local(mParity).fetch_sub(1, std::memory_order_release);
+            }
+
+        private:
+            ThreadStripes<2>& mReaders;
+            size_type mParity;
+        };
+
+        // Returns the slot holding k or table.capacity, only for the writer.
+        size_type findIndex(const Table& table, const key_type& k, size_type hash) const {
+            ctrl_t h2 = hashFragment(hashMix(hash));
+            size_type indx = table.home(hash);
+            for (size_type probes = 0; probes < table.capacity; probes++) {
+                ctrl_t c = table.ctrl[indx].load(std::memory_order_relaxed);
+                if (c == EMPTY)
+                    break;
+                if (c == h2 && mKeyEqual(table.template load<key_type>(indx, 0), k))
+                    return indx;
+                indx = indx + 1 == table.capacity ? 0 : indx + 1;
+            }
+            return table.capacity;
+        }
+
+        // Writes a key which is not in the table into the first free slot.
+        void place(Table& table, size_type hash, const key_type& k, const mapped_type& obj) {
+            size_type indx = table.home(hash);
+            while (isFull(table.ctrl[indx].load(std::memory_order_relaxed)))
+                indx = indx + 1 == table.capacity ? 0 : indx + 1;
+            if (table.ctrl[indx].load(std::memory_order_relaxed) == DELETED)
+                mDeleted--;
+            table.writeBegin(indx / Group::width);
+            table.store(indx, 0, k);
+            table.store(indx, keyWords, obj);
+            table.ctrl[indx].store(hashFragment(hashMix(hash)), std::memory_order_relaxed);
+            table.writeEnd(indx / Group::width);
+        }
+
+        // Copies the elements into a new table without tombstones, twice as
+        // large unless tombstones filled the old one, publishes it and frees
+        // the old one once its readers have left.
+        Table* rebuild(Table& old) {
+            size_type count = mCount.load(std::memory_order_relaxed);
+            size_type n = (count + 1) * 2 > maxLoadFactor * old.capacity ? old.capacity * 2 : old.capacity;
+            Table* next = new Table(n);
+            mDeleted = 0;
+            for (size_type i = 0; i < old.capacity; i++) {
+                if (isFull(old.ctrl[i].load(std::memory_order_relaxed))) {
+                    key_type k = old.template load<key_type>(i, 0);
+                    place(*next, mHash(k), k, old.template load<mapped_type>(i, keyWords));
+                }
+            }
+
+            mTable.store(next);
+            mReaders.waitIdle(mEpoch.fetch_add(1) & 1);
+            delete &old;
+            return next;
+        }
+
+        Hash mHash;
+        Pred mKeyEqual;
+        std::atomic<Table*> mTable;
+        std::atomic<size_type> mCount{ 0 };
+        // only touched by the writer
+        size_type mDeleted = 0;
+        std::mutex mWriter;
+        std::atomic<size_type> mEpoch{ 0 };
+        // readers inside a table loaded in the epoch of either parity
+        mutable ThreadStripes<2> mReaders;
+    };
+
+    // Combiners of aggregate_hash_map, which merge a value into the mapped
+    // value of an element already present.
+    struct atomic_add {
+        template <typename T>
+        void operator()(std::atomic<T>& target, const T& value) const {
+            if constexpr (std::is_integral<T>::value) {
+                target.fetch_add(value, std::memory_order_relaxed);
+            } else {
+                T current = target.load(std::memory_order_relaxed);
+                while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+            }
+        }
+    };
+
+    struct atomic_min {
+        template <typename T>
+        void operator()(std::atomic<T>& target, const T& value) const {
+            T current = target.load(std::memory_order_relaxed);
+            while (value < current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+        }
+    };
+
+    struct atomic_max {
+        template <typename T>
+        void operator()(std::atomic<T>& target, const T& value) const {
+            T current = target.load(std::memory_order_relaxed);
+            while (current < value && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+        }
+    };
+
+    /*
+    *  An insert-only hash map for parallel aggregation: threads combine
+    *  values into the elements of their keys, e.g. add up counts, instead
+    *  of filling maps of their own and merging them afterwards.
+    *
+    *  Slots are probed in the group order of hash_map's probe sequence and
+    *  claimed by a CAS on their control word, the mapped values are atomic
+    *  and updated by the combiner. Neither takes a lock: a thread only
+    *  waits for a slot claimed for a key with the same fingerprint until the
+    *  key is written. Elements are never erased.
+    *
+    *  Once the table passes its maximum load factor, the threads stop
+    *  inserting and migrate it chunk by chunk into one twice as large
+    *  together.
+    */
+    template<typename K, typename T,
+        typename Hash = std::hash<K>,
+        typename Pred = std::equal_to<K>>
+    class aggregate_hash_map {
+        static_assert(std::is_trivially_copyable<K>::value, "aggregate_hash_map copies keys into claimed slots");
+
+    public:
+        using key_type = K;
+        using mapped_type = T;
+        using hasher = Hash;
+        using key_equal = Pred;
+        using size_type = std::size_t;
+
+        /**
+         *  @brief  Creates an empty %aggregate_hash_map.
+         *  @param n  Minimal initial number of buckets.
+         */
+        explicit aggregate_hash_map(size_type n = 0) : mTable(new Table(std::max(n, Group::width))) {}
+
+        aggregate_hash_map(const aggregate_hash_map&) = delete;
+        aggregate_hash_map& operator=(const aggregate_hash_map&) = delete;
+
+        /// No other thread may be using the %aggregate_hash_map.
+        ~aggregate_hash_map() {
+            delete mTable.load(std::memory_order_relaxed);
+        }
+
+        size_type size() const noexcept {
+            return mCount.load(std::memory_order_relaxed);
+        }
+
+        bool empty() const noexcept {
+            return size() == 0;
+        }
+
+        size_type bucket_count() const {
+            OpGuard guard(*this);
+            return mTable.load()->capacity;
+        }
+
+        /**
+         *  @brief  Inserts a (key, value) pair or combines the value into the
+         *          element of the key.
+         *  @param  k        Key of the element.
+         *  @param  value    Mapped value of a new element, or the one to
+         *                   combine into the present one.
+         *  @param  combine  Called as combine(std::atomic<T>&, value) for a
+         *                   present element, e.g. atomic_add.
+         *  @return  Whether a new element was inserted.
+         */
+        template <typename _Combine>
+        bool combine(const key_type& k, const mapped_type& value, _Combine combine) {
+            size_type hash = mHash(k);
+            while (true) {
+                InsertResult result;
+                size_type capacity;
+                {
+                    OpGuard guard(*this);
+                    Table* table = mTable.load();
+                    capacity = table->capacity;
+                    result = insertOrCombine(*table, hash, k, value, combine);
+                }
+                if (result == INSERTED)
+                    mCount.fetch_add(1, std::memory_order_relaxed);
+                if (result != FULL)
+                    return result == INSERTED;
+                grow(capacity);
+            }
+        }
+
+        /// Same as combine(k, value, atomic_add()).
+        bool add(const key_type& k, const mapped_type& value) {
+            return combine(k, value, atomic_add());
+        }
+
+        /**
+         *  @brief  Copies the mapped value of a key.
+         *  @param  k    Key to look up.
+         *  @param  out  Receives the mapped value if @a k is found.
+         *  @return  Whether @a k was found.
+         */
+        bool find(const key_type& k, mapped_type& out) const {
+            size_type hash = mHash(k);
+            OpGuard guard(*this);
+            const Table* table = mTable.load();
+            uint16_t h2 = hashFragment(hashMix(hash));
+            ProbeSeq seq(table->index.index(hash), hashMix(hash), table->capacity);
+            while (true) {
+                for (size_type i = 0; i < Group::width; i++) {
+                    size_type indx = seq.base() + i;
+                    uint16_t c = table->ctrl[indx].load(std::memory_order_acquire);
+                    if (c == UNCLAIMED)
+                        return false;
+                    if ((c & fragmentMask) == h2 && mKeyEqual(table->waitKey(indx, c), k)) {
+                        out = table->values[indx].load(std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+                seq.next();
+            }
+        }
+
+        bool contains(const key_type& k) const {
+            mapped_type value;
+            return find(k, value);
+        }
+
+        /// Calls f(key, value) for every element, no thread may be inserting.
+        template <typename _F>
+        void for_each(_F&& f) const {
+            const Table* table = mTable.load();
+            for (size_type i = 0; i < table->capacity; i++) {
+                if (table->ctrl[i].load(std::memory_order_acquire) & READY)
+                    f(table->key(i), table->values[i].load(std::memory_order_relaxed));
+            }
+        }
+
+    private:
+        // Control word of a slot: the state and the 7-bit hash fragment.
+        enum SlotState : uint16_t {
+            UNCLAIMED = 0,
+            CLAIMED = 0x100,
+            READY = 0x200
+        };
+
+        enum InsertResult {
+            COMBINED,
+            INSERTED,
+            // the table has no room left for another element
+            FULL
+        };
+
+        static constexpr uint16_t fragmentMask = 0x7F;
+        static constexpr float maxLoadFactor = 0.5f;
+        static constexpr size_type migrationChunk = 4096;
+
+        struct Table {
+            explicit Table(size_type n) :
+                capacity(mask_index_policy::round_bucket_count(n)),
+                ctrl(new std::atomic<uint16_t>[capacity]),
+                keys(new KeySlot[capacity]),
+                values(new std::atomic<mapped_type>[capacity]),
+                limit(static_cast<size_type>(maxLoadFactor * capacity)) {
+                index.reset(capacity);
+                for (size_type i = 0; i < capacity; i++)
+                    ctrl[i].store(UNCLAIMED, std::memory_order_relaxed);
+            }
+
+            const key_type& key(size_type indx) const {
+                return *reinterpret_cast<const key_type*>(&keys[indx]);
+            }
+
+            // The key of a slot whose control word was c, once it is written.
+            const key_type& waitKey(size_type indx, uint16_t c) const {
+                while ((c & READY) == 0) {
+                    std::this_thread::yield();
+                    c = ctrl[indx].load(std::memory_order_acquire);
+                }
+                return key(indx);
+            }
+
+            // Claims a slot, which is the only way to change its control word.
+            // Every claim is reserved first and the reservations stop at
+            // limit, so some slots stay unclaimed and every probe ends.
+            bool claim(size_type indx, uint16_t& c, uint16_t h2) {
+                if (c != UNCLAIMED)
+                    return false;
+                if (reserved.fetch_add(1, std::memory_order_relaxed) >= limit) {
+                    reserved.fetch_sub(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (ctrl[indx].compare_exchange_strong(c, static_cast<uint16_t>(CLAIMED | h2), std::memory_order_acquire))
+                    return true;
+                reserved.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            void publish(size_type indx, uint16_t h2, const key_type& k, const mapped_type& value) {
+                new(&keys[indx]) key_type(k);
+                values[indx].store(value, std::memory_order_relaxed);
+                ctrl[indx].store(static_cast<uint16_t>(READY | h2), std::memory_order_release);
+            }
+
+            using KeySlot = typename std::aligned_storage<sizeof(key_type), alignof(key_type)>::type;
+
+            size_type capacity;
+            fibonacci_index_policy index;
+            std::unique_ptr<std::atomic<uint16_t>[]> ctrl;
+            std::unique_ptr<KeySlot[]> keys;
+            std::unique_ptr<std::atomic<mapped_type>[]> values;
+            size_type limit;
+            std::atomic<size_type> reserved{ 0 };
+        };
+
+        // A resize in progress, whose chunks the threads migrate together.
+        struct Migration {
+            Table* old;
+            Table* next;
+            size_type chunks;
+            std::atomic<size_type> claimedChunks{ 0 };
+            std::atomic<size_type> doneChunks{ 0 };
+        };
+
+        // Counts an operation on the current table for as long as it lives,
+        // helping a resize first if one is running.
+        class OpGuard {
+        public:
+            explicit OpGuard(const aggregate_hash_map& map) : mOps(map.mOps) {
+                while (true) {
+                    mOps.local(0).fetch_add(1);
+                    if (!map.mResizing.load())
+                        break;
+                    mOps.local(0).fetch_sub(1);
+                    map.helpResize();
+                }
+            }
+
+            ~OpGuard() {
+                mOps.local(0).fetch_sub(1, std::memory_order_release);
+            }
+
+        private:
+            ThreadStripes<1>& mOps;
+        };
+
+        template <typename _Combine>
+        InsertResult insertOrCombine(Table& table, size_type hash, const key_type& k, const mapped_type& value, _Combine& combine) {
+            uint16_t h2 = hashFragment(hashMix(hash));
+            ProbeSeq seq(table.index.index(hash), hashMix(hash), table.capacity);
+            while (true) {
+                for (size_type i = 0; i < Group::width; i++) {
+                    size_type indx = seq.base() + i;
+                    uint16_t c = table.ctrl[indx].load(std::memory_order_acquire);
+                    if (table.claim(indx, c, h2)) {
+                        table.publish(indx, h2, k, value);
+                        return INSERTED;
+                    }
+                    // k is not in the table and there is no room for it
+                    if (c == UNCLAIMED)
+                        return FULL;
+                    // claimed by another thread, maybe for k
+                    if ((c & fragmentMask) == h2 && mKeyEqual(table.waitKey(indx, c), k)) {
+                        combine(table.values[indx], value);
+                        return COMBINED;
+                    }
+                }
+                seq.next();
+            }
+        }
+
+        // Puts an element of a migrated table into the first free slot.
+        void place(Table& table, const key_type& k, const mapped_type& value) const {
+            size_type hash = mHash(k);
+            uint16_t h2 = hashFragment(hashMix(hash));
+            ProbeSeq seq(table.index.index(hash), hashMix(hash), table.capacity);
+            while (true) {
+                for (size_type i = 0; i < Group::width; i++) {
+                    size_type indx = seq.base() + i;
+                    uint16_t c = table.ctrl[indx].load(std::memory_order_relaxed);
+                    if (table.claim(indx, c, h2)) {
+                        table.publish(indx, h2, k, value);
+                        return;
+                    }
+                }
+                seq.next();
+            }
+        }
+
+        void migrate(Migration& migration) const {
+            size_type chunk;
+            while ((chunk = migration.claimedChunks.fetch_add(1)) < migration.chunks) {
+                size_type last = std::min((chunk + 1) * migrationChunk, migration.old->capacity);
+                for (size_type i = chunk * migrationChunk; i < last; i++) {
+                    if (migration.old->ctrl[i].load(std::memory_order_acquire) & READY)
+                        place(*migration.next, migration.old->key(i),
+                            migration.old->values[i].load(std::memory_order_relaxed));
+                }
+                migration.doneChunks.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+        void helpResize() const {
+            mHelpers.fetch_add(1);
+            if (Migration* migration = mMigration.load())
+                migrate(*migration);
+            mHelpers.fetch_sub(1);
+            while (mResizing.load())
+                std::this_thread::yield();
+        }
+
+        // Grows the table of the given capacity unless another thread did.
+        void grow(size_type capacity) {
+            bool expected = false;
+            if (!mResizing.compare_exchange_strong(expected, true)) {
+                helpResize();
+                return;
+            }
+            // no operation is inside the table from now on
+            mOps.waitIdle(0);
+            Table* old = mTable.load();
+            if (old->capacity == capacity) {
+                Migration migration;
+                migration.old = old;
+                try {
+                    migration.next = new Table(old->capacity * 2);
+                } catch (...) {
+                    mResizing.store(false);
+                    throw;
+                }
+                migration.chunks = (old->capacity + migrationChunk - 1) / migrationChunk;
+                mMigration.store(&migration);
+                migrate(migration);
+                while (migration.doneChunks.load(std::memory_order_acquire) != migration.chunks)
+                    std::this_thread::yield();
+                // a helper which saw the migration is counted before it
+                mMigration.store(nullptr);
+                while (mHelpers.load() != 0)
+                    std::this_thread::yield();
+                mTable.store(migration.next);
+                delete old;
+            }
+            mResizing.store(false);
+        }
+
+        Hash mHash;
+        Pred mKeyEqual;
+        std::atomic<Table*> mTable;
+        std::atomic<size_type> mCount{ 0 };
+        mutable std::atomic<bool> mResizing{ false };
+        mutable std::atomic<Migration*> mMigration{ nullptr };
+        mutable std::atomic<size_type> mHelpers{ 0 };
+        mutable ThreadStripes<1> mOps;
+    };
+}
@@ -2,26 +2,515 @@
 
 #include <functional>
 #include <memory>
+#include <memory_resource>
 #include <utility>
+#include <tuple>
 #include <vector>
+#include <array>
 #include <type_traits>
 #include <algorithm>
 #include <exception>
+#include <stdexcept>
 #include <climits>
+#include <cstdint>
+#include <cmath>
+#include <iterator>
+#include <numeric>
+#include <cstring>
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <thread>
+
+// Group probing matches a whole group of control bytes per step. The widest
+// instruction set available at compile time is used; define
+// FEFU_HASH_MAP_NO_SIMD to force the portable implementation.
+#if !defined(FEFU_HASH_MAP_NO_SIMD) && defined(__AVX2__)
+#define FEFU_HASH_MAP_AVX2
+#include <immintrin.h>
+#elif !defined(FEFU_HASH_MAP_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FEFU_HASH_MAP_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Defining FEFU_HASH_MAP_PROBE_COUNTERS makes every hash_map count its
+// lookups, slot searches for insertion and the probes they take, see
+// hash_map::counters(). An operation adds its probes once it is done, with
+// relaxed atomics, so concurrent const lookups may count. Without it the
+// counting compiles to nothing.
+#ifdef FEFU_HASH_MAP_PROBE_COUNTERS
+#define FEFU_HASH_MAP_COUNT(counter, n) (mCounters.counter.fetch_add((n), std::memory_order_relaxed))
+#else
+#define FEFU_HASH_MAP_COUNT(counter, n) ((void)0)
+#endif
+
+// huge_page_allocator maps its memory straight from the OS where it can.
+#if defined(__unix__) || defined(__APPLE__)
+#define FEFU_HASH_MAP_MMAP
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#define FEFU_HASH_MAP_VIRTUAL_ALLOC
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
 
 namespace fefu
 {
-    enum NodeState {
-        EMPTY,
-        CONTAINS,
-        DELETED
+    // Every slot of the table has a one byte control word. Special states are
+    // negative, a full slot keeps the 7-bit hash fragment (H2) of its key.
+    using ctrl_t = signed char;
+
+    enum NodeState : ctrl_t {
+        EMPTY = -128,
+        DELETED = -3,
+        // end of a table being migrated by an incremental rehash, see TableLink
+        LINK = -2,
+        SENTINEL = -1
     };
 
-    template <typename ValueType>
-    struct IterNode {
-        IterNode() : ptr(nullptr), state(EMPTY) {}
-        ValueType* ptr;
-        NodeState state;
+    inline bool isFull(ctrl_t c) {
+        return c >= 0;
+    }
+
+    // Stored after the control bytes of a table which is being migrated by an
+    // incremental rehash, iteration continues from it into the current table.
+    struct TableLink {
+        const ctrl_t* ctrl;
+        void* slot;
+    };
+
+    inline unsigned countTrailingZeros(uint32_t mask) {
+#if defined(_MSC_VER)
+        unsigned long indx;
+        _BitScanForward(&indx, mask);
+        return indx;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    // Mixes the user hash so that its upper bits are usable as a fingerprint.
+    // The multiplier differs from the one of fibonacci_index_policy, so the
+    // fingerprint does not repeat the bits that select the home slot.
+    inline size_t hashMix(size_t hash) {
+        if constexpr (sizeof(size_t) == 8)
+            return static_cast<size_t>(hash * 0xFF51AFD7ED558CCDull);
+        else
+            return static_cast<size_t>(hash * 0x85EBCA6Bu);
+    }
+
+    // Upper half of the full product of a and b.
+    inline size_t mulHigh(size_t a, size_t b) {
+        if constexpr (sizeof(size_t) == 4) {
+            return static_cast<size_t>((static_cast<uint64_t>(a) * b) >> 32);
+        } else {
+#if defined(__SIZEOF_INT128__)
+            return static_cast<size_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+            return __umulh(a, b);
+#else
+            uint64_t aLow = a & 0xFFFFFFFFu, aHigh = uint64_t(a) >> 32;
+            uint64_t bLow = b & 0xFFFFFFFFu, bHigh = uint64_t(b) >> 32;
+            uint64_t middle = (aLow * bLow >> 32) + (aHigh * bLow & 0xFFFFFFFFu) + aLow * bHigh;
+            return static_cast<size_t>(aHigh * bHigh + (aHigh * bLow >> 32) + (middle >> 32));
+#endif
+        }
+    }
+
+    inline ctrl_t hashFragment(size_t mixed) {
+        return static_cast<ctrl_t>(mixed >> (sizeof(size_t) * CHAR_BIT - 7));
+    }
+
+    // Hints the cache line of addr into the cache, a no-op where unsupported.
+    inline void prefetch(const void* addr) {
+#if defined(FEFU_HASH_MAP_AVX2) || defined(FEFU_HASH_MAP_SSE2)
+        _mm_prefetch(static_cast<const char*>(addr), _MM_HINT_T0);
+#elif defined(__GNUC__)
+        __builtin_prefetch(addr);
+#else
+        (void)addr;
+#endif
+    }
+
+    // Reads a control byte which other threads may claim concurrently, only
+    // used while a table is rehashed by several threads.
+    inline ctrl_t loadCtrl(const ctrl_t* ctrl) {
+#if defined(_MSC_VER)
+        return *static_cast<const volatile ctrl_t*>(ctrl);
+#else
+        return __atomic_load_n(ctrl, __ATOMIC_RELAXED);
+#endif
+    }
+
+    // Replaces a control byte by desired if it still holds expected.
+    inline bool claimCtrl(ctrl_t* ctrl, ctrl_t expected, ctrl_t desired) {
+#if defined(_MSC_VER)
+        return _InterlockedCompareExchange8(reinterpret_cast<volatile char*>(ctrl), desired, expected) == expected;
+#else
+        return __atomic_compare_exchange_n(ctrl, &expected, desired, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#endif
+    }
+
+    /*
+    *  Group of consecutive control bytes matched in one step.
+    *  Every match returns a bit mask with bit i set if the i-th byte matches.
+    */
+#if defined(FEFU_HASH_MAP_AVX2)
+    struct Group {
+        static constexpr size_t width = 32;
+
+        explicit Group(const ctrl_t* pos) : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos))) {}
+
+        uint32_t match(ctrl_t h2) const {
+            return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl)));
+        }
+
+        uint32_t matchEmpty() const {
+            return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(EMPTY), ctrl)));
+        }
+
+        uint32_t matchEmptyOrDeleted() const {
+            return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(LINK), ctrl)));
+        }
+
+        __m256i ctrl;
+    };
+#elif defined(FEFU_HASH_MAP_SSE2)
+    struct Group {
+        static constexpr size_t width = 16;
+
+        explicit Group(const ctrl_t* pos) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+        uint32_t match(ctrl_t h2) const {
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)));
+        }
+
+        uint32_t matchEmpty() const {
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(EMPTY), ctrl)));
+        }
+
+        uint32_t matchEmptyOrDeleted() const {
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(LINK), ctrl)));
+        }
+
+        __m128i ctrl;
+    };
+#else
+    struct Group {
+        static constexpr size_t width = 8;
+
+        explicit Group(const ctrl_t* pos) : ctrl(pos) {}
+
+        uint32_t match(ctrl_t h2) const {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < width; i++)
+                mask |= uint32_t(ctrl[i] == h2) << i;
+            return mask;
+        }
+
+        uint32_t matchEmpty() const {
+            return match(EMPTY);
+        }
+
+        uint32_t matchEmptyOrDeleted() const {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < width; i++)
+                mask |= uint32_t(ctrl[i] < LINK) << i;
+            return mask;
+        }
+
+        const ctrl_t* ctrl;
+    };
+#endif
+
+    template <size_t N>
+    constexpr std::array<ctrl_t, N> sentinelBytes() {
+        std::array<ctrl_t, N> bytes{};
+        for (size_t i = 0; i < N; i++)
+            bytes[i] = SENTINEL;
+        return bytes;
+    }
+
+    /*
+    *  Double hashing over groups. The home group contains the home slot, the
+    *  stride is odd, so every group of a table with a power of two number of
+    *  groups is visited.
+    */
+    class ProbeSeq {
+    public:
+        ProbeSeq(size_t home, size_t mixed, size_t capacity) :
+            mGroups((capacity + Group::width - 1) / Group::width), mGroup(home / Group::width),
+            mOffset(home % Group::width) {
+            mStride = (mGroups & (mGroups - 1)) == 0 ? ((mixed >> (sizeof(size_t) * 4)) | 1) & (mGroups - 1) : 1;
+        }
+
+        // index of the first slot of the current group
+        size_t base() const {
+            return mGroup * Group::width;
+        }
+
+        // position of the home slot inside its group
+        size_t offset() const {
+            return mOffset;
+        }
+
+        void next() {
+            mGroup += mStride;
+            if (mGroup >= mGroups)
+                mGroup -= mGroups;
+        }
+
+    private:
+        size_t mGroups;
+        size_t mGroup;
+        size_t mOffset;
+        size_t mStride;
+    };
+
+    // Hash and Pred which declare is_transparent accept any key type they can
+    // compare with key_type, the _Kt parameter only makes the check dependent.
+    template <typename T, typename _Kt, typename = void>
+    struct IsTransparent : std::false_type {};
+
+    template <typename T, typename _Kt>
+    struct IsTransparent<T, _Kt, std::void_t<typename T::is_transparent>> : std::true_type {};
+
+    // Whether the arguments of emplace() hold the key of the pair they build,
+    // so the key can be looked up before anything is constructed.
+    template <typename K, typename... _Args>
+    struct HasEmplaceKey : std::false_type {};
+
+    template <typename K, typename A, typename B>
+    struct HasEmplaceKey<K, A, B> : std::is_same<std::decay_t<A>, K> {};
+
+    template <typename K, typename A, typename B>
+    struct HasEmplaceKey<K, std::pair<A, B>> : std::is_same<std::decay_t<A>, K> {};
+
+    template <typename K, typename A, typename B>
+    struct HasEmplaceKey<K, std::piecewise_construct_t, std::tuple<A>, B> : std::is_same<std::decay_t<A>, K> {};
+
+    /*
+    *  Opt-in trait for expensive hash functions: when store_hash<Hash> is
+    *  true, every slot keeps the full hash of its key, probes compare it
+    *  before calling the key predicate and rehashing never calls Hash.
+    *  Costs sizeof(size_t) per bucket.
+    */
+    template <typename Hash>
+    struct store_hash : std::false_type {};
+
+    /*
+    *  Trait for element types which may be moved to another address by
+    *  copying their bytes, without constructing the new object or destroying
+    *  the old one. True when both the move constructor and the destructor are
+    *  trivial, and may be specialized for other types, e.g. a value_type
+    *  holding a std::unique_ptr.
+    */
+    template <typename T>
+    struct is_trivially_relocatable : std::integral_constant<bool,
+        std::is_trivially_move_constructible<T>::value && std::is_trivially_destructible<T>::value> {};
+
+    /*
+    *  Index policies choose the bucket counts a table may have and map a
+    *  hash value onto the home slot of the key. A policy object is reset
+    *  every time the table is reallocated, so it may cache per-size data.
+    */
+
+    // Power of two tables, the home slot is the hash masked by the bucket count.
+    struct mask_index_policy {
+        static size_t round_bucket_count(size_t n) {
+            if (n == 0)
+                return 0;
+            n--;
+            n |= n >> 1;
+            n |= n >> 2;
+            n |= n >> 4;
+            n |= n >> 8;
+            n |= n >> 16;
+            if constexpr (sizeof(size_t) > 4)
+                n |= n >> 32;
+            return n + 1;
+        }
+
+        void reset(size_t bucketCount) {
+            mMask = bucketCount > 0 ? bucketCount - 1 : 0;
+        }
+
+        size_t index(size_t hash) const {
+            return hash & mMask;
+        }
+
+    private:
+        size_t mMask = 0;
+    };
+
+    // Power of two tables, the home slot is taken from the upper bits of a
+    // multiplicative (Fibonacci) hash, so hashers with poor low bits, such as
+    // the identity std::hash<int>, don't cluster.
+    struct fibonacci_index_policy {
+        static size_t round_bucket_count(size_t n) {
+            if (n == 0)
+                return 0;
+            return std::max(mask_index_policy::round_bucket_count(n), size_t(2));
+        }
+
+        void reset(size_t bucketCount) {
+            mShift = sizeof(size_t) * CHAR_BIT - 1;
+            while (bucketCount > 2) {
+                bucketCount >>= 1;
+                mShift--;
+            }
+        }
+
+        size_t index(size_t hash) const {
+            if constexpr (sizeof(size_t) == 8)
+                return static_cast<size_t>(hash * 0x9E3779B97F4A7C15ull) >> mShift;
+            else
+                return static_cast<size_t>(hash * 0x9E3779B9u) >> mShift;
+        }
+
+    private:
+        size_t mShift = sizeof(size_t) * CHAR_BIT - 1;
+    };
+
+    // Prime tables, the mixed hash is reduced with a multiply-high (fast
+    // range) instead of an integer division.
+    struct prime_index_policy {
+        static size_t round_bucket_count(size_t n) {
+            static const unsigned long long primes[] = {
+            2, 3, 5, 7, 11, 13,
+            17, 29, 37, 53, 67, 97,
+            131, 193, 257, 389, 521, 769,
+            1031, 1543, 2053, 3079, 4099, 6151,
+            8209, 12289, 16411, 24593, 32771, 49157,
+            65537, 98317, 131101, 196613, 262147, 393241,
+            524309, 786433, 1048583, 1572869, 2097169, 3145739,
+            4194319, 6291469, 8388617, 12582917, 16777259, 25165843,
+            33554467, 50331653, 67108879, 100663319, 134217757, 201326611,
+            268435459, 402653189, 536870923, 805306457, 1073741827, 1610612741,
+            2147483659, 3221225473, 4294967311ull, 6442450967ull, 8589934609ull, 12884901893ull,
+            17179869209ull, 25769803799ull, 34359738421ull, 51539607599ull, 68719476767ull, 103079215111ull,
+            137438953481ull, 206158430209ull, 274877906951ull, 412316860441ull, 549755813911ull, 824633720837ull,
+            1099511627791ull, 1649267441681ull, 2199023255579ull, 3298534883417ull, 4398046511119ull, 6597069766657ull,
+            8796093022237ull, 13194139533349ull, 17592186044423ull, 26388279066671ull, 35184372088891ull, 52776558133303ull,
+            70368744177679ull, 105553116266509ull, 140737488355333ull, 211106232533047ull, 281474976710677ull, 422212465066001ull,
+            562949953421381ull, 844424930132057ull, 1125899906842679ull, 1688849860263953ull, 2251799813685269ull, 3377699720527897ull,
+            4503599627370517ull, 6755399441055827ull, 9007199254740997ull, 13510798882111519ull, 18014398509482143ull, 27021597764223071ull,
+            36028797018963971ull, 54043195528445957ull, 72057594037928017ull, 108086391056891941ull, 144115188075855881ull, 216172782113783843ull,
+            288230376151711813ull, 432345564227567621ull, 576460752303423619ull, 864691128455135281ull, 1152921504606847009ull, 1729382256910270481ull,
+            2305843009213693967ull, 3458764513820540933ull, 4611686018427388039ull, 6917529027641081903ull, 9223372036854775837ull
+            };
+            if (n == 0)
+                return 0;
+            const unsigned long long* prime = std::lower_bound(std::begin(primes), std::end(primes), n);
+            if (prime == std::end(primes) || *prime > SIZE_MAX)
+                throw std::length_error("Bucket count is too large");
+            return static_cast<size_t>(*prime);
+        }
+
+        void reset(size_t bucketCount) {
+            mBuckets = bucketCount;
+        }
+
+        size_t index(size_t hash) const {
+            if constexpr (sizeof(size_t) == 8)
+                return mulHigh(static_cast<size_t>(hash * 0x9E3779B97F4A7C15ull), mBuckets);
+            else
+                return mulHigh(static_cast<size_t>(hash * 0x9E3779B9u), mBuckets);
+        }
+
+    private:
+        size_t mBuckets = 0;
+    };
+
+    /*
+    *  Collision policies.
+    *  group_probing_policy: double hashing over groups of control bytes
+    *  matched with SIMD, erased slots may become tombstones.
+    *  robin_hood_policy: linear probing where the control byte of a slot
+    *  keeps its probe distance. Lookups of absent keys stop as soon as they
+    *  meet a slot closer to its home than the probe, and erase shifts the
+    *  following elements back, so the table never has tombstones. The shift
+    *  also invalidates iterators to the elements it moves.
+    */
+    struct group_probing_policy {
+        static constexpr bool robin_hood = false;
+    };
+
+    struct robin_hood_policy {
+        static constexpr bool robin_hood = true;
+        // Longer distances are saturated and recomputed from the hash.
+        static constexpr ctrl_t max_distance = 127;
+    };
+
+    /*
+    *  Growth policies choose the bucket count a table grows to once it
+    *  reaches its maximum load factor; the index policy then rounds it, so
+    *  prime_index_policy turns any of them into a prime sequence. A custom
+    *  policy provides the same static grow(), which must return more than
+    *  its argument.
+    */
+    template <size_t Num, size_t Den = 1>
+    struct factor_growth_policy {
+        static size_t grow(size_t bucketCount) {
+            return std::max(bucketCount + 1, bucketCount * Num / Den);
+        }
+    };
+
+    using default_growth_policy = factor_growth_policy<6>;
+    using doubling_growth_policy = factor_growth_policy<2>;
+    using half_growth_policy = factor_growth_policy<3, 2>;
+
+    // Probe lengths count the groups probed, or the slots under Robin Hood
+    // probing, see hash_map::stats(). Entry i of a histogram counts the
+    // cases of length i + 1.
+    struct probe_stats {
+        // lookups of every element
+        std::vector<std::size_t> present_probes;
+        // lookups of an absent key starting from every group, or slot
+        std::vector<std::size_t> absent_probes;
+        // slots between the home slots of the elements and their own
+        double average_displacement = 0;
+        std::size_t max_displacement = 0;
+        double tombstone_ratio = 0;
+        // runs of buckets without an empty one
+        std::vector<std::size_t> cluster_sizes;
+    };
+
+    // Totals since the last reset, see FEFU_HASH_MAP_PROBE_COUNTERS.
+    struct probe_counters {
+        std::size_t finds = 0;
+        std::size_t find_probes = 0;
+        // slot searches of insertions and rehashing
+        std::size_t inserts = 0;
+        std::size_t insert_probes = 0;
+    };
+
+    // Storage of probe_counters, updated by concurrent lookups.
+    struct ProbeCounterCells {
+        std::atomic<std::size_t> finds{ 0 };
+        std::atomic<std::size_t> find_probes{ 0 };
+        std::atomic<std::size_t> inserts{ 0 };
+        std::atomic<std::size_t> insert_probes{ 0 };
+    };
+
+    // Bytes of the tables a hash_map holds, see hash_map::memory_usage().
+    struct table_memory {
+        // control bytes, stored hashes and padding in front of the slots
+        std::size_t metadata = 0;
+        // slots holding elements
+        std::size_t payload = 0;
+        // empty slots and tombstones
+        std::size_t wasted = 0;
+
+        std::size_t total() const noexcept {
+            return metadata + payload + wasted;
+        }
     };
 
     template<typename T>
@@ -34,6 +523,8 @@ namespace fefu
         using reference = typename std::add_lvalue_reference<T>::type;
         using const_reference = typename std::add_lvalue_reference<const T>::type;
         using value_type = T;
+        using propagate_on_container_move_assignment = std::true_type;
+        using is_always_equal = std::true_type;
 
         allocator() noexcept {}
 
@@ -56,6 +547,523 @@ namespace fefu
         int debug_type = 0;
     };
 
+    template <class T, class U>
+    bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+        return true;
+    }
+
+    template <class T, class U>
+    bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+        return false;
+    }
+
+    /*
+    *  Hands out memory from large chunks with a pointer bump and frees it
+    *  only all at once, by release() or on destruction. Every chunk is twice
+    *  as large as the previous one.
+    */
+    class arena {
+    public:
+        explicit arena(std::size_t chunk = 4096) noexcept : mNextChunk(chunk) {}
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        ~arena() {
+            release();
+            freeChunk(mHead);
+        }
+
+        void* allocate(std::size_t bytes, std::size_t align) {
+            std::uintptr_t ptr = alignUp(mCur, align);
+            if (mHead == nullptr || ptr + bytes > mEnd) {
+                std::size_t size = std::max(mNextChunk, sizeof(Chunk) + bytes + align);
+                Chunk* chunk = static_cast<Chunk*>(::operator new(size));
+                chunk->next = mHead;
+                chunk->size = size;
+                mHead = chunk;
+                mCur = reinterpret_cast<std::uintptr_t>(chunk + 1);
+                mEnd = reinterpret_cast<std::uintptr_t>(chunk) + size;
+                mNextChunk = size * 2;
+                ptr = alignUp(mCur, align);
+            }
+            mCur = ptr + bytes;
+            return reinterpret_cast<void*>(ptr);
+        }
+
+        /// Frees all the memory, which nothing may use anymore, except for
+        /// the last and largest chunk kept for reuse.
+        void release() noexcept {
+            if (mHead == nullptr)
+                return;
+            while (mHead->next != nullptr) {
+                Chunk* next = mHead->next;
+                mHead->next = next->next;
+                freeChunk(next);
+            }
+            mCur = reinterpret_cast<std::uintptr_t>(mHead + 1);
+        }
+
+    private:
+        struct Chunk {
+            Chunk* next;
+            std::size_t size;
+        };
+
+        static void freeChunk(Chunk* chunk) noexcept {
+            if (chunk != nullptr)
+                ::operator delete(static_cast<void*>(chunk), chunk->size);
+        }
+
+        static std::uintptr_t alignUp(std::uintptr_t ptr, std::size_t align) {
+            return (ptr + align - 1) & ~static_cast<std::uintptr_t>(align - 1);
+        }
+
+        Chunk* mHead = nullptr;
+        std::uintptr_t mCur = 0;
+        std::uintptr_t mEnd = 0;
+        std::size_t mNextChunk;
+    };
+
+    /*
+    *  Keeps freed blocks in free lists by power of two size classes and
+    *  hands them out again, so tables of similar sizes built over and over
+    *  reuse the same memory. The blocks come from an arena, larger ones than
+    *  max_block bytes go straight to the global heap.
+    */
+    class pool {
+    public:
+        static constexpr std::size_t min_block = 16;
+        static constexpr std::size_t classes = 19;
+        static constexpr std::size_t max_block = min_block << (classes - 1);
+
+        pool() noexcept = default;
+        pool(const pool&) = delete;
+        pool& operator=(const pool&) = delete;
+
+        void* allocate(std::size_t bytes, std::size_t align) {
+            if (!pooled(bytes, align))
+                return ::operator new(bytes, std::align_val_t(align));
+            std::size_t c = sizeClass(bytes);
+            if (mFree[c] == nullptr)
+                return mArena.allocate(min_block << c, alignof(std::max_align_t));
+            FreeBlock* block = mFree[c];
+            mFree[c] = block->next;
+            return block;
+        }
+
+        void deallocate(void* p, std::size_t bytes, std::size_t align) noexcept {
+            if (!pooled(bytes, align)) {
+                ::operator delete(p, bytes, std::align_val_t(align));
+                return;
+            }
+            std::size_t c = sizeClass(bytes);
+            mFree[c] = new(p) FreeBlock{ mFree[c] };
+        }
+
+        /// Makes all the blocks free again, nothing may use them anymore.
+        void release() noexcept {
+            mArena.release();
+            std::fill(std::begin(mFree), std::end(mFree), nullptr);
+        }
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        static bool pooled(std::size_t bytes, std::size_t align) {
+            return bytes <= max_block && align <= alignof(std::max_align_t);
+        }
+
+        static std::size_t sizeClass(std::size_t bytes) {
+            std::size_t c = 0;
+            while ((min_block << c) < bytes)
+                c++;
+            return c;
+        }
+
+        arena mArena;
+        FreeBlock* mFree[classes] = {};
+    };
+
+    /*
+    *  The allocators below which hand out memory from a given resource
+    *  propagate on copy and move assignment and on swap, so the memory of a
+    *  %hash_map always stays with the allocator which can free it.
+    */
+
+    /*
+    *  Allocates from an arena and never frees anything itself: the memory
+    *  of a %hash_map, including the tables it outgrew, is returned when the
+    *  arena is released. There is no default arena, the given one has to
+    *  outlive every %hash_map using it.
+    */
+    template<typename T>
+    class arena_allocator {
+    public:
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using const_pointer = const T*;
+        using reference = typename std::add_lvalue_reference<T>::type;
+        using const_reference = typename std::add_lvalue_reference<const T>::type;
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        explicit arena_allocator(arena& a) noexcept : mArena(&a) {}
+
+        template <class U>
+        arena_allocator(const arena_allocator<U>& src) noexcept : mArena(src.resource()) {}
+
+        pointer allocate(size_type n) {
+            return static_cast<pointer>(mArena->allocate(n * sizeof(value_type), alignof(value_type)));
+        }
+
+        void deallocate(pointer, size_type) noexcept {}
+
+        arena* resource() const noexcept {
+            return mArena;
+        }
+
+    private:
+        arena* mArena;
+    };
+
+    template <class T, class U>
+    bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) noexcept {
+        return a.resource() == b.resource();
+    }
+
+    template <class T, class U>
+    bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) noexcept {
+        return a.resource() != b.resource();
+    }
+
+    /*
+    *  Allocates from a pool. There is no default pool, the given one has
+    *  to outlive every %hash_map using it.
+    */
+    template<typename T>
+    class pool_allocator {
+    public:
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using const_pointer = const T*;
+        using reference = typename std::add_lvalue_reference<T>::type;
+        using const_reference = typename std::add_lvalue_reference<const T>::type;
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        explicit pool_allocator(pool& p) noexcept : mPool(&p) {}
+
+        template <class U>
+        pool_allocator(const pool_allocator<U>& src) noexcept : mPool(src.resource()) {}
+
+        pointer allocate(size_type n) {
+            return static_cast<pointer>(mPool->allocate(n * sizeof(value_type), alignof(value_type)));
+        }
+
+        void deallocate(pointer p, size_type n) noexcept {
+            mPool->deallocate(p, n * sizeof(value_type), alignof(value_type));
+        }
+
+        pool* resource() const noexcept {
+            return mPool;
+        }
+
+    private:
+        pool* mPool;
+    };
+
+    template <class T, class U>
+    bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b) noexcept {
+        return a.resource() == b.resource();
+    }
+
+    template <class T, class U>
+    bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b) noexcept {
+        return a.resource() != b.resource();
+    }
+
+    /*
+    *  Allocates from a std::pmr::memory_resource, the default resource
+    *  unless one is given. Unlike std::pmr::polymorphic_allocator it
+    *  propagates.
+    */
+    template<typename T>
+    class pmr_allocator {
+    public:
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using const_pointer = const T*;
+        using reference = typename std::add_lvalue_reference<T>::type;
+        using const_reference = typename std::add_lvalue_reference<const T>::type;
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        pmr_allocator() noexcept : mResource(std::pmr::get_default_resource()) {}
+
+        pmr_allocator(std::pmr::memory_resource* r) noexcept : mResource(r) {}
+
+        template <class U>
+        pmr_allocator(const pmr_allocator<U>& src) noexcept : mResource(src.resource()) {}
+
+        pointer allocate(size_type n) {
+            return static_cast<pointer>(mResource->allocate(n * sizeof(value_type), alignof(value_type)));
+        }
+
+        void deallocate(pointer p, size_type n) noexcept {
+            mResource->deallocate(p, n * sizeof(value_type), alignof(value_type));
+        }
+
+        std::pmr::memory_resource* resource() const noexcept {
+            return mResource;
+        }
+
+    private:
+        std::pmr::memory_resource* mResource;
+    };
+
+    template <class T, class U>
+    bool operator==(const pmr_allocator<T>& a, const pmr_allocator<U>& b) noexcept {
+        return *a.resource() == *b.resource();
+    }
+
+    template <class T, class U>
+    bool operator!=(const pmr_allocator<T>& a, const pmr_allocator<U>& b) noexcept {
+        return !(a == b);
+    }
+
+    /*
+    *  Takes allocations of at least huge_page bytes straight from the OS,
+    *  rounded up to whole huge pages and aligned to one: explicit huge pages
+    *  when the system has them reserved, otherwise ordinary pages the kernel
+    *  is advised to back with transparent huge pages. A table starts on a
+    *  page boundary, so no group of control bytes crosses a page. Smaller
+    *  allocations use the global heap.
+    */
+    template<typename T>
+    class huge_page_allocator {
+    public:
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using const_pointer = const T*;
+        using reference = typename std::add_lvalue_reference<T>::type;
+        using const_reference = typename std::add_lvalue_reference<const T>::type;
+        using value_type = T;
+        using is_always_equal = std::true_type;
+
+        static constexpr size_type huge_page = size_type(2) << 20;
+
+        huge_page_allocator() noexcept {}
+
+        template <class U>
+        huge_page_allocator(const huge_page_allocator<U>&) noexcept {}
+
+        pointer allocate(size_type n) {
+            size_type bytes = n * sizeof(value_type);
+            if (bytes < huge_page)
+                return static_cast<pointer>(::operator new(bytes));
+            void* ptr = mapPages(roundUp(bytes));
+            if (ptr == nullptr)
+                throw std::bad_alloc();
+            return static_cast<pointer>(ptr);
+        }
+
+        void deallocate(pointer p, size_type n) noexcept {
+            size_type bytes = n * sizeof(value_type);
+            if (bytes < huge_page)
+                ::operator delete(static_cast<void*>(p), bytes);
+            else
+                unmapPages(p, roundUp(bytes));
+        }
+
+    private:
+        static size_type roundUp(size_type bytes) {
+            return (bytes + huge_page - 1) / huge_page * huge_page;
+        }
+
+        static void* mapPages(size_type bytes) {
+#if defined(FEFU_HASH_MAP_MMAP)
+#ifdef MAP_HUGETLB
+            void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (ptr != MAP_FAILED)
+                return ptr;
+#endif
+            // mmap() only aligns to a small page, so the extra huge page
+            // around the aligned part is unmapped again
+            char* mapped = static_cast<char*>(mmap(nullptr, bytes + huge_page, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (mapped == MAP_FAILED)
+                return nullptr;
+            size_type head = (huge_page - reinterpret_cast<std::uintptr_t>(mapped) % huge_page) % huge_page;
+            if (head > 0)
+                munmap(mapped, head);
+            munmap(mapped + head + bytes, huge_page - head);
+#ifdef MADV_HUGEPAGE
+            madvise(mapped + head, bytes, MADV_HUGEPAGE);
+#endif
+            return mapped + head;
+#elif defined(FEFU_HASH_MAP_VIRTUAL_ALLOC)
+            // large pages need the SeLockMemoryPrivilege
+            void* ptr = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (ptr == nullptr)
+                ptr = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            return ptr;
+#else
+            return ::operator new(bytes, std::align_val_t(huge_page), std::nothrow);
+#endif
+        }
+
+        static void unmapPages(void* p, size_type bytes) noexcept {
+#if defined(FEFU_HASH_MAP_MMAP)
+            munmap(p, bytes);
+#elif defined(FEFU_HASH_MAP_VIRTUAL_ALLOC)
+            VirtualFree(p, 0, MEM_RELEASE);
+#else
+            ::operator delete(p, bytes, std::align_val_t(huge_page));
+#endif
+        }
+    };
+
+    template <class T, class U>
+    bool operator==(const huge_page_allocator<T>&, const huge_page_allocator<U>&) noexcept {
+        return true;
+    }
+
+    template <class T, class U>
+    bool operator!=(const huge_page_allocator<T>&, const huge_page_allocator<U>&) noexcept {
+        return false;
+    }
+
+    // Totals of a counting_allocator, shared by all of its copies.
+    struct allocation_counter {
+        std::atomic<std::size_t> live_bytes{ 0 };
+        std::atomic<std::size_t> peak_bytes{ 0 };
+        std::atomic<std::size_t> allocations{ 0 };
+        std::atomic<std::size_t> deallocations{ 0 };
+
+        void allocated(std::size_t bytes) noexcept {
+            std::size_t live = live_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+            std::size_t peak = peak_bytes.load(std::memory_order_relaxed);
+            while (peak < live && !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void deallocated(std::size_t bytes) noexcept {
+            live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+            deallocations.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    /// The counter of default constructed counting_allocator objects.
+    inline allocation_counter& default_allocation_counter() {
+        static allocation_counter counter;
+        return counter;
+    }
+
+    /*
+    *  Passes every call to another allocator and records it in an
+    *  allocation_counter, e.g. one per shard to budget its memory. Like the
+    *  allocators above it propagates, so the memory stays accounted to the
+    *  counter it was allocated from.
+    */
+    template<typename T, typename Alloc = allocator<T>>
+    class counting_allocator {
+    public:
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using const_pointer = const T*;
+        using reference = typename std::add_lvalue_reference<T>::type;
+        using const_reference = typename std::add_lvalue_reference<const T>::type;
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        template <class U>
+        struct rebind {
+            using other = counting_allocator<U, typename std::allocator_traits<Alloc>::template rebind_alloc<U>>;
+        };
+
+        counting_allocator() : mCounter(&default_allocation_counter()) {}
+
+        explicit counting_allocator(allocation_counter& counter, const Alloc& alloc = Alloc()) :
+            mAlloc(alloc), mCounter(&counter) {}
+
+        template <class U, class A>
+        counting_allocator(const counting_allocator<U, A>& src) : mAlloc(src.inner()), mCounter(&src.counter()) {}
+
+        pointer allocate(size_type n) {
+            pointer ptr = mAlloc.allocate(n);
+            mCounter->allocated(n * sizeof(value_type));
+            return ptr;
+        }
+
+        void deallocate(pointer p, size_type n) noexcept {
+            mAlloc.deallocate(p, n);
+            mCounter->deallocated(n * sizeof(value_type));
+        }
+
+        const Alloc& inner() const noexcept {
+            return mAlloc;
+        }
+
+        allocation_counter& counter() const noexcept {
+            return *mCounter;
+        }
+
+    private:
+        Alloc mAlloc;
+        allocation_counter* mCounter;
+    };
+
+    template <class T, class A, class U, class B>
+    bool operator==(const counting_allocator<T, A>& a, const counting_allocator<U, B>& b) noexcept {
+        return &a.counter() == &b.counter() && a.inner() == b.inner();
+    }
+
+    template <class T, class A, class U, class B>
+    bool operator!=(const counting_allocator<T, A>& a, const counting_allocator<U, B>& b) noexcept {
+        return !(a == b);
+    }
+
+
+    // Moves an iterator position of either constness to the next full slot,
+    // following the TableLink of a table being migrated and passing over the
+    // slots from skip to the end of the table.
+    template <typename Slot>
+    void skipEmptySlots(const ctrl_t*& ctrl, Slot*& slot, const ctrl_t* skip) {
+        while (true) {
+            while (*ctrl < LINK && ctrl != skip) {
+                ++ctrl;
+                ++slot;
+            }
+            // the rest of the table was already visited
+            if (ctrl == skip) {
+                while (*ctrl != LINK && *ctrl != SENTINEL) {
+                    ++ctrl;
+                    ++slot;
+                }
+            }
+            if (*ctrl != LINK)
+                return;
+            TableLink link;
+            std::memcpy(&link, ctrl + Group::width, sizeof(link));
+            ctrl = link.ctrl;
+            slot = static_cast<Slot*>(link.slot);
+        }
+    }
 
     template<typename ValueType>
     class hash_map_iterator {
@@ -66,25 +1074,26 @@ namespace fefu
         using reference = ValueType&;
         using pointer = ValueType*;
 
-        hash_map_iterator() noexcept : node(nullptr) {}
-        hash_map_iterator(const hash_map_iterator& other) noexcept : node(other.node) {}
+        hash_map_iterator() noexcept : ctrl(nullptr), slot(nullptr) {}
+        hash_map_iterator(const hash_map_iterator& other) noexcept : ctrl(other.ctrl), slot(other.slot), skip(other.skip) {}
+        hash_map_iterator& operator=(const hash_map_iterator& other) noexcept = default;
 
         reference operator*() const {
-            if (node == nullptr || node->ptr == nullptr)
+            if (ctrl == nullptr || !isFull(*ctrl))
                 throw std::out_of_range("Iterator is out of range");
-            return *(node->ptr);
+            return *slot;
         }
         pointer operator->() const {
-            return node->ptr;
+            return slot;
         }
 
         // prefix ++
         hash_map_iterator& operator++() {
-            if (node->ptr == nullptr)
+            if (ctrl == nullptr || *ctrl == SENTINEL)
                 throw std::out_of_range("Iterator is out of range");
-            ++node;
-            while (node->ptr != nullptr && node->state != CONTAINS)
-                ++node;
+            ++ctrl;
+            ++slot;
+            skipEmpty();
             return *this;
         }
         // postfix ++
@@ -95,25 +1104,32 @@ namespace fefu
         }
 
         friend bool operator==(const hash_map_iterator<ValueType>& lhs, const hash_map_iterator<ValueType>& rhs) {
-            return (lhs.node == rhs.node);
+            return (lhs.ctrl == rhs.ctrl);
         }
         friend bool operator!=(const hash_map_iterator<ValueType>& lhs, const hash_map_iterator<ValueType>& rhs) {
             return !(lhs == rhs);
         }
 
-        template<typename A, typename B, typename C, typename D, typename E>
+        template<typename A, typename B, typename C, typename D, typename E, typename F, typename G, typename H>
         friend class hash_map;
 
         template<typename R>
         friend class hash_map_const_iterator;
 
     private:
-        hash_map_iterator(IterNode<ValueType>* iterNode) : node(iterNode) {
-            while (node->state != CONTAINS && node->ptr != nullptr)
-                ++node;
+        hash_map_iterator(const ctrl_t* ctrlPos, ValueType* slotPos) : ctrl(ctrlPos), slot(slotPos) {
+            skipEmpty();
+        }
+
+        void skipEmpty() {
+            skipEmptySlots(ctrl, slot, skip);
         }
 
-        IterNode<ValueType>* node;
+        const ctrl_t* ctrl;
+        ValueType* slot;
+        // first of the last slots of the table, whose elements were already
+        // visited, see hash_map::erase()
+        const ctrl_t* skip = nullptr;
     };
 
     template<typename ValueType>
@@ -126,26 +1142,27 @@ namespace fefu
         using reference = const ValueType&;
         using pointer = const ValueType*;
 
-        hash_map_const_iterator() noexcept : node(nullptr) {}
-        hash_map_const_iterator(const hash_map_const_iterator& other) noexcept : node(other.node) {}
-        hash_map_const_iterator(const hash_map_iterator<ValueType>& other) noexcept : node(other.node) {}
+        hash_map_const_iterator() noexcept : ctrl(nullptr), slot(nullptr) {}
+        hash_map_const_iterator(const hash_map_const_iterator& other) noexcept : ctrl(other.ctrl), slot(other.slot), skip(other.skip) {}
+        hash_map_const_iterator& operator=(const hash_map_const_iterator& other) noexcept = default;
+        hash_map_const_iterator(const hash_map_iterator<ValueType>& other) noexcept : ctrl(other.ctrl), slot(other.slot), skip(other.skip) {}
 
         reference operator*() const {
-            if (node == nullptr || node->ptr == nullptr)
+            if (ctrl == nullptr || !isFull(*ctrl))
                 throw std::out_of_range("Iterator is out of range");
-            return *(node->ptr);
+            return *slot;
         }
         pointer operator->() const {
-            return node->ptr;
+            return slot;
         }
 
         // prefix ++
         hash_map_const_iterator& operator++() {
-            if (node->ptr == nullptr)
+            if (ctrl == nullptr || *ctrl == SENTINEL)
                 throw std::out_of_range("Iterator is out of range");
-            ++node;
-            while (node->ptr != nullptr && node->state != CONTAINS)
-                ++node;
+            ++ctrl;
+            ++slot;
+            skipEmpty();
             return *this;
         }
         // postfix ++
@@ -156,36 +1173,54 @@ namespace fefu
         }
 
         friend bool operator==(const hash_map_const_iterator<ValueType>& lhs, const hash_map_const_iterator<ValueType>& rhs) {
-            return (lhs.node == rhs.node);
+            return (lhs.ctrl == rhs.ctrl);
         }
         friend bool operator!=(const hash_map_const_iterator<ValueType>& lhs, const hash_map_const_iterator<ValueType>& rhs) {
             return !(lhs == rhs);
         }
 
-        template<typename A, typename B, typename C, typename D, typename E>
+        template<typename A, typename B, typename C, typename D, typename E, typename F, typename G, typename H>
         friend class hash_map;
 
     private:
-        hash_map_const_iterator(IterNode<ValueType>* iterNode) : node(iterNode) {
-            while (node->state != CONTAINS && node->ptr != nullptr)
-                node++;
+        hash_map_const_iterator(const ctrl_t* ctrlPos, const ValueType* slotPos) : ctrl(ctrlPos), slot(slotPos) {
+            skipEmpty();
+        }
+
+        void skipEmpty() {
+            skipEmptySlots(ctrl, slot, skip);
         }
 
-        IterNode<ValueType>* node;
+        const ctrl_t* ctrl;
+        const ValueType* slot;
+        // first of the last slots of the table, whose elements were already
+        // visited, see hash_map::erase()
+        const ctrl_t* skip = nullptr;
     };
 
     template<typename K, typename T,
         typename Hash = std::hash<K>,
         typename Pred = std::equal_to<K>,
-        typename Alloc = allocator<std::pair<const K, T>>>
+        typename Alloc = allocator<std::pair<const K, T>>,
+        typename IndexPolicy = mask_index_policy,
+        typename CollisionPolicy = group_probing_policy,
+        typename GrowthPolicy = default_growth_policy>
     class hash_map
     {
+        // return type of the lookups which take any key type _Kt
+        template <typename _Kt, typename _Res>
+        using IfTransparent = typename std::enable_if<IsTransparent<Hash, _Kt>::value
+            && IsTransparent<Pred, _Kt>::value, _Res>::type;
+
     public:
         using key_type = K;
         using mapped_type = T;
         using hasher = Hash;
         using key_equal = Pred;
         using allocator_type = Alloc;
+        using index_policy = IndexPolicy;
+        using collision_policy = CollisionPolicy;
+        using growth_policy = GrowthPolicy;
         using value_type = std::pair<const key_type, mapped_type>;
         using reference = value_type&;
         using const_reference = const value_type&;
@@ -194,17 +1229,14 @@ namespace fefu
         using size_type = std::size_t;
 
         /// Default constructor.
-        hash_map() : mData(nullptr), mNodes(1) {}
+        hash_map() : mCtrl(emptyCtrl()), mData(nullptr) {}
 
         /**
          *  @brief  Default constructor creates no elements.
          *  @param n  Minimal initial number of buckets.
          */
-        explicit hash_map(size_type n) : mData(mAlloc.allocate(getPowerOfTwo(n))) {
-            n = getPowerOfTwo(n);
-            mNodes = std::vector<IterNode<value_type>>(n + 1);
-            for (size_type i = 0; i < n; i++)
-                mNodes[i].ptr = mData + i;
+        explicit hash_map(size_type n) {
+            initTable(IndexPolicy::round_bucket_count(n));
         }
 
         /**
@@ -226,28 +1258,32 @@ namespace fefu
         /// Copy constructor.
         hash_map(const hash_map& src) : mAlloc(src.mAlloc), mHash(src.mHash), mKeyEqual(src.mKeyEqual),
                                         mCount(src.mCount), mDeleted(src.mDeleted), maxLoadFactor(src.maxLoadFactor),
-                                        mNodes(src.mNodes) {
-            mData = mAlloc.allocate(src.mNodes.size() - 1);
-
-            for (size_t i = 0; i < mNodes.size() - 1; i++) {
-                if (src.mNodes[i].state == CONTAINS) {
-                    new(mData + i) value_type(src.mData[i]);
-                }
-            }
+                                        minLoadFactor(src.minLoadFactor), mPeak(src.mPeak),
+                                        mIncrementalStep(src.mIncrementalStep) {
+            copyTable(src);
         }
 
         /// Move constructor.
-        hash_map(hash_map&& rvalue) : mAlloc(std::move(rvalue.mAlloc)), mKeyEqual(std::move(rvalue.mKeyEqual)), mHash(std::move(rvalue.mHash)), 
-            mCount(std::move(rvalue.mCount)), mDeleted(std::move(rvalue.mDeleted)), maxLoadFactor(std::move(rvalue.maxLoadFactor)),
-            mNodes(std::move(rvalue.mNodes)), mData(std::move(rvalue.mData)) {
+        hash_map(hash_map&& rvalue) : mAlloc(std::move(rvalue.mAlloc)), mHash(std::move(rvalue.mHash)), mKeyEqual(std::move(rvalue.mKeyEqual)),
+            mCount(rvalue.mCount), mDeleted(rvalue.mDeleted), maxLoadFactor(rvalue.maxLoadFactor),
+            minLoadFactor(rvalue.minLoadFactor), mPeak(rvalue.mPeak),
+            mCtrl(rvalue.mCtrl), mData(rvalue.mData), mHashes(rvalue.mHashes), mCapacity(rvalue.mCapacity),
+            mIndex(rvalue.mIndex), mOld(std::move(rvalue.mOld)), mMigrated(rvalue.mMigrated),
+            mIncrementalStep(rvalue.mIncrementalStep) {
+            rvalue.mCtrl = emptyCtrl();
+            rvalue.mHashes = nullptr;
+            rvalue.mCapacity = 0;
+            rvalue.mIndex.reset(0);
             rvalue.mData = nullptr;
+            rvalue.mCount = 0;
+            rvalue.mDeleted = 0;
         }
 
         /**
          *  @brief Creates an %hash_map with no elements.
          *  @param a An allocator object.
          */
-        explicit hash_map(const allocator_type& a) : mAlloc(a), mNodes(1) {
+        explicit hash_map(const allocator_type& a) : mAlloc(a), mCtrl(emptyCtrl()) {
             mData = nullptr;
         }
 
@@ -257,16 +1293,11 @@ namespace fefu
         * @param  a  An allocator object.
         */
         hash_map(const hash_map& umap,
-            const allocator_type& a) : mAlloc(a), mCount(umap.mCount), mDeleted(umap.mDeleted), mNodes(umap.mNodes.size()) {
-
-            mData = mAlloc.allocate(umap.mNodes.size() - 1);
-
-            for (size_t i = 0; i < mNodes.size() - 1; i++) {
-                if (umap.mNodes[i].state == CONTAINS) {
-                    mNodes[i].state = CONTAINS;
-                    new(mData + i) value_type(umap.mData[i]);
-                }
-            }
+            const allocator_type& a) : mAlloc(a), mHash(umap.mHash), mKeyEqual(umap.mKeyEqual),
+                                    mCount(umap.mCount), mDeleted(umap.mDeleted), maxLoadFactor(umap.maxLoadFactor),
+                                    minLoadFactor(umap.minLoadFactor), mPeak(umap.mPeak),
+                                    mIncrementalStep(umap.mIncrementalStep) {
+            copyTable(umap);
         }
 
         /*
@@ -276,17 +1307,28 @@ namespace fefu
         */
         hash_map(hash_map&& umap,
             const allocator_type& a) : mAlloc(a), mHash(std::move(umap.mHash)), mKeyEqual(std::move(umap.mKeyEqual)),
-                                    mCount(std::move(umap.mCount)), mDeleted(std::move(umap.mDeleted)), maxLoadFactor(std::move(umap.maxLoadFactor)),
-                                    mNodes(std::move(umap.mNodes)) {
-            mData = mAlloc.allocate(mNodes.size() - 1);
-
-            for (size_t i = 0; i < mNodes.size() - 1; i++) {
-                if (mNodes[i].state == CONTAINS) {
-                    new(mData + i) value_type(std::move(umap.mData[i]));
+                                    mCount(umap.mCount), mDeleted(umap.mDeleted), maxLoadFactor(umap.maxLoadFactor),
+                                    minLoadFactor(umap.minLoadFactor), mPeak(umap.mPeak),
+                                    mOld(std::move(umap.mOld)), mMigrated(umap.mMigrated), mIncrementalStep(umap.mIncrementalStep) {
+            initTable(umap.bucket_count());
+            copyCtrl(umap);
+
+            for (size_type i = 0; i < bucket_count(); i++) {
+                if (isFull(mCtrl[i])) {
+                    relocate(mData + i, umap.mData + i);
                 }
             }
-            umap.mAlloc.deallocate(umap.mData, mNodes.size() - 1);
+            umap.deallocateTable(umap.mCtrl, umap.bucket_count());
+            umap.mCtrl = emptyCtrl();
+            umap.mHashes = nullptr;
+            umap.mCapacity = 0;
+            umap.mIndex.reset(0);
             umap.mData = nullptr;
+            umap.mCount = 0;
+            umap.mDeleted = 0;
+            // the table being migrated keeps its own allocator
+            if (mOld)
+                mOld->linkTo(*this);
         }
 
         /**
@@ -301,27 +1343,24 @@ namespace fefu
             size_type n = 0) : hash_map(l.begin(), l.end(), n) {}
 
         ~hash_map() {
-            if (mNodes.size() > 0) {
-                for (size_type i = 0; i < mNodes.size() - 1; i++) {
-                    if (mNodes[i].state == CONTAINS)
-                        mData[i].~value_type();
-                }
-            }
-            
-            mAlloc.deallocate(mData, mNodes.size() - 1);
+            destroyTable();
         }
 
         /// Copy assignment operator.
         hash_map& operator=(const hash_map&src) {
-            hash_map(src).swap(*this);
+            if constexpr (alloc_traits::propagate_on_container_copy_assignment::value && swapsAlloc)
+                hash_map(src).swap(*this);
+            else
+                hash_map(src, mAlloc).swap(*this);
             return *this;
         }
 
         /// Move assignment operator.
         hash_map& operator=(hash_map&&src) {
-            mAlloc.deallocate(mData, mNodes.size() - 1);
-            mData = nullptr;
-            swap(src);
+            if ((alloc_traits::propagate_on_container_move_assignment::value && swapsAlloc) || mAlloc == src.mAlloc)
+                hash_map(std::move(src)).swap(*this);
+            else
+                hash_map(std::move(src), mAlloc).swap(*this);
             return *this;
         }
 
@@ -337,7 +1376,9 @@ namespace fefu
          *  of elements assigned.
          */
         hash_map& operator=(std::initializer_list<value_type> l) {
-            hash_map(l).swap(*this);
+            hash_map tmp(mAlloc);
+            tmp.insert(l);
+            tmp.swap(*this);
             return *this;
         }
 
@@ -350,12 +1391,12 @@ namespace fefu
 
         ///  Returns true if the %hash_map is empty.
         bool empty() const noexcept {
-            return (mCount == 0);
+            return (size() == 0);
         }
 
         ///  Returns the size of the %hash_map.
         size_type size() const noexcept {
-            return mCount;
+            return mOld ? mCount + mOld->mCount : mCount;
         }
 
         ///  Returns the maximum size of the %hash_map.
@@ -363,6 +1404,119 @@ namespace fefu
             return SIZE_MAX;
         }
 
+        /**
+         *  @brief  Returns the bytes of the tables allocated from the
+         *          allocator.
+         *
+         *  During an incremental rehash both tables are counted. Memory the
+         *  elements themselves allocate is not.
+         */
+        table_memory memory_usage() const noexcept {
+            table_memory usage = mOld ? mOld->memory_usage() : table_memory();
+            if (bucket_count() > 0) {
+                usage.metadata += headerUnits(bucket_count()) * sizeof(value_type);
+                usage.payload += mCount * sizeof(value_type);
+                usage.wasted += (bucket_count() - mCount) * sizeof(value_type);
+            }
+            return usage;
+        }
+
+        /**
+         *  @brief  Measures the probe lengths and the clustering of the
+         *          %hash_map.
+         *
+         *  Walks the whole table, which should not be done on the hot path.
+         *  During an incremental rehash only the new table is measured.
+         */
+        probe_stats stats() const {
+            probe_stats result;
+            size_type n = bucket_count();
+            if (n == 0)
+                return result;
+
+            size_type totalDisplacement = 0;
+            for (size_type i = 0; i < n; i++) {
+                if (!isFull(mCtrl[i]))
+                    continue;
+                size_type hash = hashAt(i);
+                size_type home = mIndex.index(hash);
+                size_type displacement = i >= home ? i - home : i + n - home;
+                totalDisplacement += displacement;
+                result.max_displacement = std::max(result.max_displacement, displacement);
+                if constexpr (CollisionPolicy::robin_hood) {
+                    addToHistogram(result.present_probes, displacement + 1);
+                } else {
+                    ProbeSeq seq(home, hashMix(hash), n);
+                    size_type probes = 1;
+                    for (; seq.base() != i - i % Group::width; seq.next())
+                        probes++;
+                    addToHistogram(result.present_probes, probes);
+                }
+            }
+            if (mCount > 0)
+                result.average_displacement = static_cast<double>(totalDisplacement) / mCount;
+            result.tombstone_ratio = static_cast<double>(mDeleted) / n;
+
+            if constexpr (CollisionPolicy::robin_hood) {
+                for (size_type home = 0; home < n; home++) {
+                    size_type indx = home;
+                    int dist = 0;
+                    while (mCtrl[indx] >= storedDistance(dist)) {
+                        indx = nextSlot(indx);
+                        dist++;
+                    }
+                    addToHistogram(result.absent_probes, dist + 1);
+                }
+            } else {
+                // the stride of a key starting at a group varies with its hash
+                size_type groups = (n + Group::width - 1) / Group::width;
+                for (size_type g = 0; g < groups; g++) {
+                    ProbeSeq seq(g * Group::width, hashMix(g), n);
+                    size_type probes = 1;
+                    for (; Group(mCtrl + seq.base()).matchEmpty() == 0 && probes < groups; seq.next())
+                        probes++;
+                    addToHistogram(result.absent_probes, probes);
+                }
+            }
+
+            size_type start = 0;
+            while (start < n && mCtrl[start] != EMPTY)
+                start++;
+            if (start == n) {
+                addToHistogram(result.cluster_sizes, n);
+            } else {
+                size_type run = 0;
+                for (size_type k = 1; k <= n; k++) {
+                    if (mCtrl[(start + k) % n] != EMPTY) {
+                        run++;
+                    } else if (run > 0) {
+                        addToHistogram(result.cluster_sizes, run);
+                        run = 0;
+                    }
+                }
+            }
+            return result;
+        }
+
+#ifdef FEFU_HASH_MAP_PROBE_COUNTERS
+        /// Returns the probes counted since construction or the last reset.
+        probe_counters counters() const noexcept {
+            probe_counters result;
+            result.finds = mCounters.finds.load(std::memory_order_relaxed);
+            result.find_probes = mCounters.find_probes.load(std::memory_order_relaxed);
+            result.inserts = mCounters.inserts.load(std::memory_order_relaxed);
+            result.insert_probes = mCounters.insert_probes.load(std::memory_order_relaxed);
+            return result;
+        }
+
+        void reset_counters() noexcept {
+            mCounters.finds.store(0, std::memory_order_relaxed);
+            mCounters.find_probes.store(0, std::memory_order_relaxed);
+            mCounters.inserts.store(0, std::memory_order_relaxed);
+            mCounters.insert_probes.store(0, std::memory_order_relaxed);
+        }
+#endif
+
         // iterators.
 
         /**
@@ -370,7 +1524,9 @@ namespace fefu
          *  %hash_map.
          */
         iterator begin() noexcept {
-            return iterator((decltype(iterator::node))&mNodes[0]);
+            if (mOld)
+                return mOld->begin();
+            return iterator(mCtrl, mData);
         }
 
         //@{
@@ -379,11 +1535,13 @@ namespace fefu
          *  element in the %hash_map.
          */
         const_iterator begin() const noexcept {
-            return const_iterator((decltype(iterator::node))&mNodes[0]);
+            if (mOld)
+                return static_cast<const hash_map&>(*mOld).begin();
+            return const_iterator(mCtrl, mData);
         }
 
         const_iterator cbegin() const noexcept {
-            return const_iterator((decltype(iterator::node))&mNodes[0]);
+            return begin();
         }
 
         /**
@@ -391,7 +1549,7 @@ namespace fefu
          *  the %hash_map.
          */
         iterator end() noexcept {
-            return iterator((decltype(const_iterator::node))&mNodes[mNodes.size() - 1]);
+            return iterator(mCtrl + bucket_count(), mData + bucket_count());
         }
 
         //@{
@@ -400,11 +1558,11 @@ namespace fefu
          *  element in the %hash_map.
          */
         const_iterator end() const noexcept {
-            return const_iterator((decltype(const_iterator::node))&mNodes[mNodes.size() - 1]);
+            return const_iterator(mCtrl + bucket_count(), mData + bucket_count());
         }
 
         const_iterator cend() const noexcept {
-            return const_iterator((decltype(const_iterator::node))&mNodes[mNodes.size() - 1]);
+            return const_iterator(mCtrl + bucket_count(), mData + bucket_count());
         }
         //@}
 
@@ -427,12 +1585,20 @@ namespace fefu
         *  An %hash_map relies on unique keys and thus a %pair is only
         *  inserted if its first element (the key) is not already present in the
         *  %hash_map.
+        *  When @a args are a key and a mapped value, a pair, or a piecewise
+        *  key tuple with a single key element, the key is looked up first
+        *  and the pair is only ever constructed in its slot.
         *
         *  Insertion requires amortized constant time.
         */
         template<typename... _Args>
         std::pair<iterator, bool> emplace(_Args&&... args) {
-            return insert(value_type(std::forward<_Args&&>(args)...));
+            if constexpr (HasEmplaceKey<key_type, std::decay_t<_Args>...>::value) {
+                const key_type& k = emplacedKey(args...);
+                return innerEmplace(mHash(k), k, std::forward<_Args>(args)...);
+            } else {
+                return insert(value_type(std::forward<_Args>(args)...));
+            }
         }
 
         /**
@@ -459,13 +1625,32 @@ namespace fefu
          */
         template <typename... _Args>
         std::pair<iterator, bool> try_emplace(const key_type& k, _Args&&... args) {
-            return innerTryEmplace(k, std::forward<_Args>(args)...);
+            return innerTryEmplace(mHash(k), k, std::forward<_Args>(args)...);
         }
 
         // move-capable overload
         template <typename... _Args>
         std::pair<iterator, bool> try_emplace(key_type&& k, _Args&&... args) {
-            return innerTryEmplace(std::move(k), std::forward<_Args>(args)...);
+            return innerTryEmplace(mHash(k), std::move(k), std::forward<_Args>(args)...);
+        }
+
+        /**
+         *  @brief Same as try_emplace(k, args...) for a key whose hash is
+         *  already known.
+         *  @param k     Key to use for finding a possibly existing pair.
+         *  @param hash  The value of hash_key(k).
+         *  @param args  Arguments used to generate the .second for a
+         *                new pair instance.
+         */
+        template <typename... _Args>
+        std::pair<iterator, bool> try_emplace_with_hash(const key_type& k, size_type hash, _Args&&... args) {
+            return innerTryEmplace(hash, k, std::forward<_Args>(args)...);
+        }
+
+        // move-capable overload
+        template <typename... _Args>
+        std::pair<iterator, bool> try_emplace_with_hash(key_type&& k, size_type hash, _Args&&... args) {
+            return innerTryEmplace(hash, std::move(k), std::forward<_Args>(args)...);
         }
 
         //@{
@@ -486,15 +1671,30 @@ namespace fefu
         *  Insertion requires amortized constant time.
         */
         std::pair<iterator, bool> insert(const value_type& x) {
-            return innerInsert(x);
+            return innerInsert(x, mHash(x.first));
         }
 
         std::pair<iterator, bool> insert(value_type&& x) {
-            return innerInsert(std::move(x));
+            return innerInsert(std::move(x), mHash(x.first));
         }
 
         //@}
 
+        //@{
+        /**
+         *  @brief Same as insert(x) for a key whose hash is already known.
+         *  @param x     Pair to be inserted.
+         *  @param hash  The value of hash_key(x.first).
+         */
+        std::pair<iterator, bool> insert_with_hash(const value_type& x, size_type hash) {
+            return innerInsert(x, hash);
+        }
+
+        std::pair<iterator, bool> insert_with_hash(value_type&& x, size_type hash) {
+            return innerInsert(std::move(x), hash);
+        }
+        //@}
+
         /**
          *  @brief A template function that attempts to insert a range of
          *  elements.
@@ -506,8 +1706,145 @@ namespace fefu
          */
         template<typename _InputIterator>
         void insert(_InputIterator first, _InputIterator last) {
-            for (auto it = first; it != last; it++) {
-                insert(*it);
+            insert_bulk(first, last);
+        }
+
+        /**
+         *  @brief Inserts a range of elements in batches.
+         *  @param  first  Iterator pointing to the start of the range to be
+         *                   inserted.
+         *  @param  last  Iterator pointing to the end of the range.
+         *
+         *  For forward iterators the %hash_map grows at most once, to fit the
+         *  whole range, and then every batch of elements is hashed and has
+         *  its home slots prefetched before it is inserted. Input iterators
+         *  are inserted one by one.
+         */
+        template<typename _InputIterator>
+        void insert_bulk(_InputIterator first, _InputIterator last) {
+            using category = typename std::iterator_traits<_InputIterator>::iterator_category;
+            if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+                size_type n = size() + std::distance(first, last);
+                if (n + mDeleted > maxLoadFactor * bucket_count())
+                    reserve(n);
+
+                size_type hashes[lookupBatch];
+                while (first != last) {
+                    _InputIterator batch = first;
+                    size_type count = 0;
+                    for (; count < lookupBatch && first != last; ++first, ++count) {
+                        hashes[count] = mHash(static_cast<const key_type&>((*first).first));
+                        prefetchHome(hashes[count]);
+                    }
+                    for (size_type i = 0; i < count; ++batch, ++i) {
+                        innerInsert(*batch, hashes[i]);
+                    }
+                }
+            } else {
+                for (auto it = first; it != last; it++) {
+                    insert(*it);
+                }
+            }
+        }
+
+        /**
+         *  @brief Inserts a range of elements with several threads.
+         *  @param  first    Random access iterator pointing to the start of the
+         *                     range to be inserted.
+         *  @param  last     Iterator pointing to the end of the range.
+         *  @param  threads  Number of threads, the calling one included.
+         *
+         *  The %hash_map grows once to fit the range and is split into one
+         *  region of slots per thread. The elements are hashed in parallel and
+         *  sorted by the region of their home slot, which is a prefix of the
+         *  hash for the fibonacci and prime index policies, then every thread
+         *  inserts the elements of its own region, so no slot is shared. The
+         *  few elements whose probe sequence leaves their region are inserted
+         *  by the calling thread at the end. Of equal keys the first one is
+         *  inserted, as with insert(). Hash and the constructor of value_type
+         *  must be safe to call concurrently. Small ranges and Robin Hood
+         *  probing are inserted by the calling thread alone.
+         */
+        template<typename _RandomAccessIterator>
+        void insert_bulk(_RandomAccessIterator first, _RandomAccessIterator last, size_type threads) {
+            size_type count = static_cast<size_type>(last - first);
+            threads = std::min(threads, count / parallelSlots);
+            if (CollisionPolicy::robin_hood || threads <= 1) {
+                insert_bulk(first, last);
+                return;
+            }
+            finishRehash();
+            size_type n = size() + count;
+            if (n + mDeleted > maxLoadFactor * bucket_count())
+                reserve(n);
+
+            size_type groups = (bucket_count() + Group::width - 1) / Group::width;
+            size_type regionGroups = (groups + threads - 1) / threads;
+            size_type regions = (groups + regionGroups - 1) / regionGroups;
+            auto regionOf = [&](size_type hash) {
+                return mIndex.index(hash) / Group::width / regionGroups;
+            };
+
+            // offsets[r * threads + t] is where the elements of region r hashed
+            // by thread t start in order
+            std::vector<size_type> hashes(count);
+            std::vector<size_type> offsets(regions * threads + 1);
+            size_type chunk = (count + threads - 1) / threads;
+            runParallel(threads, [&](size_type t) {
+                std::vector<size_type> counts(regions);
+                for (size_type i = t * chunk; i < std::min(count, (t + 1) * chunk); i++) {
+                    hashes[i] = mHash(static_cast<const key_type&>(first[i].first));
+                    counts[regionOf(hashes[i])]++;
+                }
+                for (size_type r = 0; r < regions; r++)
+                    offsets[r * threads + t + 1] = counts[r];
+            });
+            std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+            std::vector<size_type> order(count);
+            runParallel(threads, [&](size_type t) {
+                std::vector<size_type> next(regions);
+                for (size_type r = 0; r < regions; r++)
+                    next[r] = offsets[r * threads + t];
+                for (size_type i = t * chunk; i < std::min(count, (t + 1) * chunk); i++)
+                    order[next[regionOf(hashes[i])]++] = i;
+            });
+
+            std::vector<std::vector<size_type>> overflow(regions);
+            std::vector<std::pair<size_type, size_type>> tallies(regions);
+            auto commitTallies = [&] {
+                for (const std::pair<size_type, size_type>& tally : tallies) {
+                    mCount += tally.first;
+                    mDeleted -= tally.second;
+                }
+            };
+            try {
+                runParallel(regions, [&](size_type r) {
+                    size_type regionFirst = r * regionGroups * Group::width;
+                    size_type regionLast = regionFirst + regionGroups * Group::width;
+                    size_type placed = 0, reused = 0;
+                    try {
+                        for (size_type k = offsets[r * threads]; k < offsets[(r + 1) * threads]; k++) {
+                            size_type i = order[k];
+                            if (!placeInRegion(first[i], hashes[i], regionFirst, regionLast, placed, reused))
+                                overflow[r].push_back(i);
+                        }
+                    } catch (...) {
+                        tallies[r] = std::make_pair(placed, reused);
+                        throw;
+                    }
+                    tallies[r] = std::make_pair(placed, reused);
+                });
+            } catch (...) {
+                commitTallies();
+                throw;
+            }
+            commitTallies();
+            mPeak = std::max(mPeak, size());
+
+            for (const std::vector<size_type>& rest : overflow) {
+                for (size_type i : rest)
+                    innerInsert(first[i], hashes[i]);
             }
         }
 
@@ -567,17 +1904,32 @@ namespace fefu
          *  Note that this function only erases the element, and that if the
          *  element is itself a pointer, the pointed-to memory is not touched in
          *  any way.  Managing the pointer is the user's responsibility.
+         *  With robin_hood_policy the elements following @a position in its
+         *  probe run move back one slot, so iterators to them are
+         *  invalidated as well; only the returned iterator may be used to
+         *  continue an iteration.
          */
         iterator erase(const_iterator position) {
-            if (position == this->cend())
+            if (position.ctrl == nullptr || position == this->cend())
                 throw std::out_of_range("Cant erase end iterator");
-            (*position.node).ptr->~value_type();
-            (*position.node).state = DELETED;
-            position++;
-            mDeleted++;
-            mCount--;
-
-            return iterator(position.node);
+            // no migration here, so erasing while iterating visits every element once
+            if (mOld && mOld->ownsSlot(position.ctrl))
+                return mOld->erase(position);
+            size_type indx = position.slot - mData;
+            size_type visited = position.skip != nullptr && ownsSlot(position.skip) ?
+                position.skip - mCtrl : bucket_count();
+            size_type shifted = eraseAt(indx);
+
+            // Robin Hood erase moves the next element into the erased slot.
+            if constexpr (!CollisionPolicy::robin_hood)
+                indx++;
+            // The last slots hold elements which were already visited: the
+            // ones the first slots wrapped around into. When the shift passes
+            // through them, one more joins them and the iteration stops a slot
+            // earlier.
+            if (indx < visited && visited <= indx + shifted)
+                visited--;
+            return iteratorAt(indx, visited < bucket_count() ? mCtrl + visited : nullptr);
         }
 
         // LWG 2059.
@@ -599,11 +1951,23 @@ namespace fefu
          *  any way.  Managing the pointer is the user's responsibility.
          */
         size_type erase(const key_type& x) {
-            auto it = find(x);
-            if (it == cend())
-                return 0;
-            erase(it);
-            return 1;
+            return innerErase(x, mHash(x));
+        }
+
+        // transparent overload, enabled when Hash and Pred are transparent
+        template <typename _Kt>
+        IfTransparent<_Kt, size_type> erase(const _Kt& x) {
+            return innerErase(x, mHash(x));
+        }
+
+        /**
+         *  @brief Same as erase(x) for a key whose hash is already known.
+         *  @param  x     Key of element to be erased.
+         *  @param  hash  The value of hash_key(x).
+         *  @return  The number of elements erased.
+         */
+        size_type erase_with_hash(const key_type& x, size_type hash) {
+            return innerErase(x, hash);
         }
 
         /**
@@ -619,19 +1983,32 @@ namespace fefu
          *  Note that this function only erases the elements, and that if
          *  the element is itself a pointer, the pointed-to memory is not touched
          *  in any way.  Managing the pointer is the user's responsibility.
+         *  With robin_hood_policy the element of @a last may move back, and
+         *  the returned iterator points to where it is afterwards.
          */
         iterator erase(const_iterator first, const_iterator last) {
-            for (auto it = first; it != last; ++it) {
-                erase(it);
+            if constexpr (CollisionPolicy::robin_hood) {
+                // Erasing shifts the following elements, last among them, so
+                // the range is followed by its length instead of its end.
+                for (auto n = std::distance(first, last); n > 0; n--)
+                    first = erase(first);
+                iterator next(first.ctrl, const_cast<value_type*>(first.slot));
+                next.skip = first.skip;
+                return next;
+            }
+            while (first != last) {
+                first = erase(first);
             }
-            return iterator(last.node);
+            return iterator(last.ctrl, const_cast<value_type*>(last.slot));
         }
 
         template <typename Pred_>
         void erase_if(Pred_ pred) {
-            for (auto it = begin(); it != end(); ++it) {
+            for (auto it = begin(); it != end();) {
                 if (pred(*it)) {
-                    erase(it);
+                    it = erase(it);
+                } else {
+                    ++it;
                 }
             }
         }
@@ -641,9 +2018,19 @@ namespace fefu
          *  Note that this function only erases the elements, and that if the
          *  elements themselves are pointers, the pointed-to memory is not touched
          *  in any way.  Managing the pointer is the user's responsibility.
+         *  The buckets are kept free of tombstones for reuse, unless a
+         *  min_load_factor() is set.
          */
         void clear() noexcept {
-            erase(this->begin(), this->end());
+            destroyElements();
+            if (bucket_count() > 0)
+                std::memset(mCtrl, EMPTY, bucket_count());
+            mCount = 0;
+            mDeleted = 0;
+            mOld.reset();
+            // an empty table shrinks to no buckets, which cannot throw
+            if (minLoadFactor != 0.0f)
+                shrink_to_fit();
         }
 
         /**
@@ -652,32 +2039,53 @@ namespace fefu
          *  types.
          *
          *  This exchanges the elements between two %hash_map in constant
-         *  time.
+         *  time, unless the allocators differ and do not propagate on swap:
+         *  then the elements are moved over into tables of the other
+         *  allocator, which is linear.
          *  Note that the global std::swap() function is specialized such that
          *  std::swap(m1,m2) will feed to this function.
          */
         void swap(hash_map& x) {
             using std::swap;
 
-            if constexpr (std::allocator_traits<Alloc>::propagate_on_container_swap::value)
-                swap(this->mAlloc, x.mAalloc);
+            if constexpr (!swapsAlloc) {
+                // each table has to go back to the allocator it came from
+                if (mAlloc != x.mAlloc) {
+                    hash_map mine(std::move(*this), x.mAlloc);
+                    hash_map theirs(std::move(x), mAlloc);
+                    theirs.swap(*this);
+                    mine.swap(x);
+                    return;
+                }
+            }
+
+            if constexpr (alloc_traits::propagate_on_container_swap::value)
+                swap(this->mAlloc, x.mAlloc);
 
             swap(this->mData, x.mData);
-            swap(this->mNodes, x.mNodes);
+            swap(this->mCtrl, x.mCtrl);
+            swap(this->mCapacity, x.mCapacity);
+            swap(this->mHashes, x.mHashes);
             swap(this->mCount, x.mCount);
             swap(this->mDeleted, x.mDeleted);
             swap(this->maxLoadFactor, x.maxLoadFactor);
+            swap(this->minLoadFactor, x.minLoadFactor);
+            swap(this->mPeak, x.mPeak);
             swap(this->mKeyEqual, x.mKeyEqual);
             swap(this->mHash, x.mHash);
+            swap(this->mIndex, x.mIndex);
+            swap(this->mOld, x.mOld);
+            swap(this->mMigrated, x.mMigrated);
+            swap(this->mIncrementalStep, x.mIncrementalStep);
         }
 
-        template<typename _H2, typename _P2>
-        void merge(hash_map<K, T, _H2, _P2, Alloc>& source) {
+        template<typename _H2, typename _P2, typename _I2, typename _C2, typename _G2>
+        void merge(hash_map<K, T, _H2, _P2, Alloc, _I2, _C2, _G2>& source) {
             innerMerge(source);
         }
 
-        template<typename _H2, typename _P2>
-        void merge(hash_map<K, T, _H2, _P2, Alloc>&& source) {
+        template<typename _H2, typename _P2, typename _I2, typename _C2, typename _G2>
+        void merge(hash_map<K, T, _H2, _P2, Alloc, _I2, _C2, _G2>&& source) {
             innerMerge(std::move(source));
         }
 
@@ -695,6 +2103,18 @@ namespace fefu
             return mKeyEqual;
         }
 
+        /**
+         *  @brief  Hashes a key the way the %hash_map does.
+         *  @param  k  Key to hash.
+         *  @return  The value expected by the *_with_hash members.
+         *
+         *  The value only depends on the hash functor, so it may be computed
+         *  once and passed to every %hash_map with an equal hash_function().
+         */
+        size_type hash_key(const key_type& k) const {
+            return mHash(k);
+        }
+
         // lookup.
 
         //@{
@@ -710,21 +2130,39 @@ namespace fefu
          *  past-the-end ( @c end() ) iterator.
          */
         iterator find(const key_type& x) {
-            if (mCount == 0)
-                return end();
-            size_type indx = innerSearch(x);
-            if (mNodes[indx].state == CONTAINS) {
-                return iterator((decltype(iterator::node))&mNodes[indx]);
-            }
-            return end();
+            return innerFind(x, mHash(x));
         }
 
         const_iterator find(const key_type& x) const {
-            size_type indx = innerSearch(x);
-            if (mNodes[indx].state == CONTAINS) {
-                return iterator((decltype(iterator::node))&mNodes[indx]);
-            }
-            return end();
+            return innerFind(x, mHash(x));
+        }
+
+        // transparent overloads, enabled when Hash and Pred are transparent
+        template <typename _Kt>
+        IfTransparent<_Kt, iterator> find(const _Kt& x) {
+            return innerFind(x, mHash(x));
+        }
+
+        template <typename _Kt>
+        IfTransparent<_Kt, const_iterator> find(const _Kt& x) const {
+            return innerFind(x, mHash(x));
+        }
+        //@}
+
+        //@{
+        /**
+         *  @brief Same as find(x) for a key whose hash is already known.
+         *  @param  x     Key to be located.
+         *  @param  hash  The value of hash_key(x).
+         *  @return  Iterator pointing to sought-after element, or end() if not
+         *           found.
+         */
+        iterator find_with_hash(const key_type& x, size_type hash) {
+            return innerFind(x, hash);
+        }
+
+        const_iterator find_with_hash(const key_type& x, size_type hash) const {
+            return innerFind(x, hash);
         }
         //@}
 
@@ -741,14 +2179,93 @@ namespace fefu
             return contains(x);
         }
 
+        template <typename _Kt>
+        IfTransparent<_Kt, size_type> count(const _Kt& x) const {
+            return contains(x);
+        }
+
         /**
          *  @brief  Finds whether an element with the given key exists.
          *  @param  x  Key of elements to be located.
          *  @return  True if there is any element with the specified key.
          */
         bool contains(const key_type& x) const {
-            size_type indx = innerSearch(x);
-            return (mNodes[indx].state == CONTAINS);
+            return lookup(x, mHash(x)).first != nullptr;
+        }
+
+        template <typename _Kt>
+        IfTransparent<_Kt, bool> contains(const _Kt& x) const {
+            return lookup(x, mHash(x)).first != nullptr;
+        }
+
+        /**
+         *  @brief  Same as contains(x) for a key whose hash is already known.
+         *  @param  x     Key of elements to be located.
+         *  @param  hash  The value of hash_key(x).
+         */
+        bool contains_with_hash(const key_type& x, size_type hash) const {
+            return lookup(x, hash).first != nullptr;
+        }
+
+        //@{
+        /**
+         *  @brief Locates a range of keys.
+         *  @param  first  Forward iterator to the first key.
+         *  @param  last   Forward iterator past the last key.
+         *  @param  out    Output iterator receiving one find() result per key.
+         *  @return  @a out past the last written result.
+         *
+         *  The keys are processed in batches: a batch is hashed and the home
+         *  slots of all its keys are prefetched before any of them is probed,
+         *  so the cache misses of independent lookups overlap.
+         */
+        template <typename _ForwardIterator, typename _OutputIterator>
+        _OutputIterator find_many(_ForwardIterator first, _ForwardIterator last, _OutputIterator out) {
+            size_type hashes[lookupBatch];
+            while (first != last) {
+                _ForwardIterator batchEnd = prefetchBatch(first, last, hashes);
+                for (size_type i = 0; first != batchEnd; ++first, ++i) {
+                    *out = innerFind(static_cast<const key_type&>(*first), hashes[i]);
+                    ++out;
+                }
+            }
+            return out;
+        }
+
+        template <typename _ForwardIterator, typename _OutputIterator>
+        _OutputIterator find_many(_ForwardIterator first, _ForwardIterator last, _OutputIterator out) const {
+            size_type hashes[lookupBatch];
+            while (first != last) {
+                _ForwardIterator batchEnd = prefetchBatch(first, last, hashes);
+                for (size_type i = 0; first != batchEnd; ++first, ++i) {
+                    *out = innerFind(static_cast<const key_type&>(*first), hashes[i]);
+                    ++out;
+                }
+            }
+            return out;
+        }
+        //@}
+
+        /**
+         *  @brief Finds whether each key of a range exists.
+         *  @param  first  Forward iterator to the first key.
+         *  @param  last   Forward iterator past the last key.
+         *  @param  out    Output iterator receiving one bool per key.
+         *  @return  @a out past the last written result.
+         *
+         *  Batched like find_many().
+         */
+        template <typename _ForwardIterator, typename _OutputIterator>
+        _OutputIterator contains_many(_ForwardIterator first, _ForwardIterator last, _OutputIterator out) const {
+            size_type hashes[lookupBatch];
+            while (first != last) {
+                _ForwardIterator batchEnd = prefetchBatch(first, last, hashes);
+                for (size_type i = 0; first != batchEnd; ++first, ++i) {
+                    *out = lookup(static_cast<const key_type&>(*first), hashes[i]).first != nullptr;
+                    ++out;
+                }
+            }
+            return out;
         }
 
         //@{
@@ -765,11 +2282,27 @@ namespace fefu
          *  Lookup requires constant time.
          */
         mapped_type& operator[](const key_type& k) {
-            return innerOperator(k);
+            return innerOperator(k, mHash(k));
         }
 
         mapped_type& operator[](key_type&& k) {
-            return innerOperator(std::move(k));
+            return innerOperator(std::move(k), mHash(k));
+        }
+        //@}
+
+        //@{
+        /**
+         *  @brief  Same as operator[](k) for a key whose hash is already known.
+         *  @param  k     The key for which data should be retrieved.
+         *  @param  hash  The value of hash_key(k).
+         *  @return  A reference to the data of the (key,data) %pair.
+         */
+        mapped_type& subscript_with_hash(const key_type& k, size_type hash) {
+            return innerOperator(k, hash);
+        }
+
+        mapped_type& subscript_with_hash(key_type&& k, size_type hash) {
+            return innerOperator(std::move(k), hash);
         }
         //@}
 
@@ -782,21 +2315,21 @@ namespace fefu
          *  @throw  std::out_of_range  If no such data is present.
          */
         mapped_type& at(const key_type& k) {
-            size_type indx = innerSearch(k);
-            if (mNodes[indx].state != CONTAINS) {
-                throw std::out_of_range("This key is not presented in map");
-            }
-
-            return mData[indx].second;
+            return innerAt(k);
         }
 
         const mapped_type& at(const key_type& k) const {
-            size_type indx = innerSearch(k);
-            if (mNodes[indx].state != CONTAINS) {
-                throw std::out_of_range("This key is not presented in map");
-            }
+            return innerAt(k);
+        }
+
+        template <typename _Kt>
+        IfTransparent<_Kt, mapped_type&> at(const _Kt& k) {
+            return innerAt(k);
+        }
 
-            return mData[indx].second;
+        template <typename _Kt>
+        IfTransparent<_Kt, const mapped_type&> at(const _Kt& k) const {
+            return innerAt(k);
         }
         //@}
 
@@ -804,7 +2337,7 @@ namespace fefu
 
         /// Returns the number of buckets of the %hash_map.
         size_type bucket_count() const noexcept {
-            return (mNodes.size() - 1);
+            return mCapacity;
         }
 
         /*
@@ -813,18 +2346,23 @@ namespace fefu
         * @return  The key bucket index.
         */
         size_type bucket(const key_type& _K) const {
-            size_type indx = innerSearch(_K);
-            if (mNodes[indx].state != CONTAINS) {
-                throw std::out_of_range("This key is not presented in map");
-            }
-            return indx;
+            return innerBucket(_K);
+        }
+
+        template <typename _Kt>
+        IfTransparent<_Kt, size_type> bucket(const _Kt& _K) const {
+            return innerBucket(_K);
         }
 
         // hash policy.
         
-        /// Returns the average number of elements per bucket.
+        /// Returns the average number of elements per bucket. Tombstones left
+        /// by erasing count as elements, as they take up buckets until the
+        /// next rehash.
         float load_factor() const noexcept {
-            return (mCount * 1.0f + mDeleted) / (mNodes.size() - 1);
+            if (bucket_count() == 0)
+                return 0.0f;
+            return (size() * 1.0f + mDeleted) / bucket_count();
         }
 
         /// Returns a positive number that the %hash_map tries to keep the
@@ -840,28 +2378,168 @@ namespace fefu
         void max_load_factor(float z) {
             if (z <= 0.0 || z >= 1)
                 throw std::invalid_argument("Load factor must be positive and less than 1");
+            if (z <= minLoadFactor)
+                throw std::invalid_argument("Maximum load factor must be greater than the minimum one");
             maxLoadFactor = z;
             checkForRehash();
         }
 
+        /// Returns the load factor under which erasing by key or clear()
+        /// shrinks the %hash_map, 0 if it never shrinks.
+        float min_load_factor() const noexcept {
+            return minLoadFactor;
+        }
+
+        /**
+         *  @brief  Change the %hash_map minimum load factor.
+         *  @param  z The new minimum load factor, 0 disables shrinking.
+         *
+         *  Once erase() by key or clear() leaves the load factor below @a z,
+         *  the %hash_map is rehashed to a load factor halfway between the
+         *  minimum and the maximum ones. For hysteresis it also has to hold
+         *  less than half of the most elements it had since its last resize,
+         *  so alternating insertions and erasures around either mark never
+         *  rehash more than once per O(size()) operations.
+         *  Erasing through iterators never shrinks the %hash_map.
+         */
+        void min_load_factor(float z) {
+            if (z < 0.0 || z >= maxLoadFactor)
+                throw std::invalid_argument("Minimum load factor must be non-negative and less than the maximum one");
+            minLoadFactor = z;
+        }
+
+        /**
+         *  @brief  Rehashes the %hash_map to the fewest buckets which keep
+         *          the load factor under max_load_factor().
+         *
+         *  Drops every tombstone, and all the storage of an empty %hash_map.
+         */
+        void shrink_to_fit() {
+            rehash(0);
+        }
+
         /**
          *  @brief  May rehash the %hash_map.
          *  @param  n The new number of buckets.
          *
          *  Rehash will occur only if the new number of buckets respect the
          *  %hash_map maximum load factor.
+         *  If Hash or the move of an element throws, the %hash_map is left
+         *  as it was. Elements which may throw when moved, and with Robin
+         *  Hood probing those whose Hash may throw, are copied for that,
+         *  unless they can't be, and then a throwing move loses them.
          */
         void rehash(size_type n) {
-            n = getPowerOfTwo(n);
+            finishRehash();
+            n = IndexPolicy::round_bucket_count(std::max(n, static_cast<size_type>(std::ceil(mCount / maxLoadFactor))));
+            // Robin Hood placement may hash the keys of long runs again
+            if constexpr ((!nothrowRelocate || (CollisionPolicy::robin_hood && !nothrowHash))
+                && std::is_copy_constructible<value_type>::value) {
+                rehashByCopy(n);
+                return;
+            }
+            // every key is hashed before the table changes
+            std::vector<size_type> hashes;
+            if constexpr (!nothrowHash) {
+                hashes.reserve(mCount);
+                for (size_type i = 0; i < bucket_count(); i++) {
+                    if (isFull(mCtrl[i]))
+                        hashes.push_back(mHash(mData[i].first));
+                }
+            }
+            ctrl_t* oldCtrl = mCtrl;
+            value_type* oldData = mData;
+            size_type* oldHashes = mHashes;
+            size_type oldCapacity = bucket_count();
+
+            initTable(n);
+            auto hashed = hashes.begin();
+            for (size_type i = 0; i < oldCapacity; i++) {
+                if (isFull(oldCtrl[i])) {
+                    size_type hash;
+                    if constexpr (storeHash)
+                        hash = oldHashes[i];
+                    else if constexpr (nothrowHash)
+                        hash = mHash(oldData[i].first);
+                    else
+                        hash = *hashed++;
+                    std::pair<size_type, ctrl_t> slot = findInsertSlot(hash);
+                    relocate(mData + slot.first, oldData + i);
+                    mCtrl[slot.first] = slot.second;
+                    if constexpr (storeHash)
+                        mHashes[slot.first] = hash;
+                }
+            }
             mDeleted = 0;
-            hash_map newHashMap(n);
-            for (size_type i = 0; i < mNodes.size() - 1; i++) {
-                if (mNodes[i].state == CONTAINS) {
-                    mCount++;
-                    newHashMap.emplace(std::move(mData[i].first), std::move(mData[i].second));
+            mPeak = mCount;
+            deallocateTable(oldCtrl, oldCapacity);
+        }
+
+        // Same as rehash(n), the elements are copied into a new table which
+        // only replaces the current one once all of them are there.
+        void rehashByCopy(size_type n) {
+            hash_map copy(mAlloc);
+            copy.mHash = mHash;
+            copy.initTable(n);
+            for (size_type i = 0; i < bucket_count(); i++) {
+                if (isFull(mCtrl[i])) {
+                    size_type hash = hashAt(i);
+                    copy.constructAt(copy.findInsertSlot(hash), hash, mData[i]);
                 }
             }
-            swap(newHashMap);
+            // copy destroys the previous elements
+            std::swap(mCtrl, copy.mCtrl);
+            std::swap(mData, copy.mData);
+            std::swap(mHashes, copy.mHashes);
+            std::swap(mCapacity, copy.mCapacity);
+            std::swap(mIndex, copy.mIndex);
+            mDeleted = 0;
+            mPeak = mCount;
+        }
+
+        /**
+         *  @brief  Same as rehash(n), moving the elements with several threads.
+         *  @param  n        The new number of buckets.
+         *  @param  threads  Number of threads, the calling one included.
+         *
+         *  The old table is split into one range of slots per thread and every
+         *  thread claims the new slots of its elements with a compare-and-swap
+         *  on their control bytes. Hash must be safe to call concurrently.
+         *  Small tables, Robin Hood probing, which shifts elements on every
+         *  insertion, and elements whose hash (unless stored) or moves may
+         *  throw are rehashed by the calling thread alone, as by rehash(n).
+         */
+        void rehash(size_type n, size_type threads) {
+            threads = std::min(threads, bucket_count() / parallelSlots);
+            if (CollisionPolicy::robin_hood || !parallelRehashable || threads <= 1) {
+                rehash(n);
+                return;
+            }
+            finishRehash();
+            n = IndexPolicy::round_bucket_count(std::max(n, static_cast<size_type>(std::ceil(mCount / maxLoadFactor))));
+            ctrl_t* oldCtrl = mCtrl;
+            value_type* oldData = mData;
+            size_type* oldHashes = mHashes;
+            size_type oldCapacity = bucket_count();
+
+            initTable(n);
+            size_type chunk = (oldCapacity + threads - 1) / threads;
+            auto moveRange = [&](size_type first) {
+                size_type last = std::min(first + chunk, oldCapacity);
+                for (size_type i = first; i < last; i++) {
+                    if (isFull(oldCtrl[i])) {
+                        size_type hash = storeHash ? oldHashes[i] : mHash(oldData[i].first);
+                        size_type indx = claimInsertIndex(hash);
+                        relocate(mData + indx, oldData + i);
+                        if constexpr (storeHash)
+                            mHashes[indx] = hash;
+                    }
+                }
+            };
+            runParallel(threads, [&](size_type t) { moveRange(t * chunk); });
+            mDeleted = 0;
+            mPeak = mCount;
+            deallocateTable(oldCtrl, oldCapacity);
         }
 
         /**
@@ -875,13 +2553,40 @@ namespace fefu
             rehash(ceil(n / maxLoadFactor));
         }
 
+        /**
+         *  @brief  Enables incremental rehashing of the %hash_map.
+         *  @param  slots  Minimum number of slots of the previous table
+         *                 migrated by every insertion or erasure by key, 0
+         *                 disables it.
+         *
+         *  When the %hash_map grows, the previous table is kept alongside
+         *  the new one and its elements are moved a few at a time, so no
+         *  single insertion pays for a whole rehash. Lookups consult both
+         *  tables until the migration is over. An operation migrates more
+         *  than @a slots when the migration would otherwise not be over
+         *  before the new table has to grow in turn.
+         *  Compacting the tombstones of group probing is not incremental: the
+         *  insertion which finds the table full of them still rehashes its
+         *  buckets in place at once.
+         */
+        void incremental_rehash(size_type slots) {
+            mIncrementalStep = slots;
+            if (slots == 0)
+                finishRehash();
+        }
+
+        /// Returns the number of slots migrated per operation, 0 if the
+        /// %hash_map rehashes at once.
+        size_type incremental_rehash() const noexcept {
+            return mIncrementalStep;
+        }
+
         bool operator==(const hash_map& other) const {
             if (this->size() != other.size())
                 return false;
 
-            for (size_type i = 0; i < mNodes.size() - 1; i++) {
-                if (mNodes[i].state == CONTAINS && (!other.contains(mData[i].first)
-                                    || other.at(mData[i].first) != mData[i].second)) {
+            for (const value_type& el : *this) {
+                if (!other.contains(el.first) || other.at(el.first) != el.second) {
                     return false;
                 }
             }
@@ -896,126 +2601,870 @@ namespace fefu
         size_type mCount = 0;
         size_type mDeleted = 0;
         float maxLoadFactor = 0.4f;
-
-        std::vector<IterNode<value_type>> mNodes;
+        float minLoadFactor = 0.0f;
+        // most elements held since the last rehash
+        size_type mPeak = 0;
+
+        // A single block from mAlloc holds bucket_count() control bytes, a
+        // group of SENTINEL bytes, the TableLink written by linkTo(), the
+        // stored hashes if any and then the slots, starting at the first
+        // value_type aligned offset.
+        ctrl_t* mCtrl;
         value_type* mData;
+        size_type* mHashes = nullptr;
+        size_type mCapacity = 0;
+        IndexPolicy mIndex;
+
+        // previous table while an incremental rehash moves its elements here
+        std::unique_ptr<hash_map> mOld;
+        size_type mMigrated = 0;
+        size_type mIncrementalStep = 0;
+        // element followed through the moves of a migration step, see migrateAfter()
+        std::pair<hash_map*, size_type>* mPinned = nullptr;
+
+        // keys hashed and prefetched ahead of probing by find_many()
+        static constexpr size_type lookupBatch = 16;
+        // slots or elements per thread below which parallel work uses fewer threads
+        static constexpr size_type parallelSlots = 1 << 14;
+        static constexpr size_type ctrlTail = Group::width + sizeof(TableLink);
+        static constexpr bool storeHash = store_hash<Hash>::value;
+        // Whether finding the hash of a stored element never throws.
+        static constexpr bool nothrowHash = storeHash || std::is_nothrow_invocable<const Hash&, const key_type&>::value;
+        // Whether relocate() never throws.
+        static constexpr bool nothrowRelocate = is_trivially_relocatable<value_type>::value
+            || (std::is_nothrow_move_constructible<key_type>::value
+                && std::is_nothrow_move_constructible<mapped_type>::value);
+        // A worker of rehash(n, threads) which throws couldn't undo the moves
+        // of the other ones, so throwing hashes and moves are left to
+        // rehash(n), which keeps the table when they throw.
+        static constexpr bool parallelRehashable = nothrowHash && nothrowRelocate;
+
+#ifdef FEFU_HASH_MAP_PROBE_COUNTERS
+        mutable ProbeCounterCells mCounters;
+#endif
+
+        using alloc_traits = std::allocator_traits<Alloc>;
+        // Whether a table allocated by another allocator may be swapped in.
+        static constexpr bool swapsAlloc = alloc_traits::propagate_on_container_swap::value
+            || alloc_traits::is_always_equal::value;
+
+        // Control bytes of every table without buckets, never written.
+        static ctrl_t* emptyCtrl() {
+            static constexpr std::array<ctrl_t, ctrlTail> group = sentinelBytes<ctrlTail>();
+            return const_cast<ctrl_t*>(group.data());
+        }
+
+        // Byte offset of the stored hashes in the block of n buckets, if the
+        // block is aligned for size_type.
+        static size_type hashesOffset(size_type n) {
+            return (n + ctrlTail + alignof(size_type) - 1) / alignof(size_type) * alignof(size_type);
+        }
+
+        // The allocator only aligns the block for value_type, so the stored
+        // hashes may have to start up to this many bytes further.
+        static constexpr size_type hashesSlack = alignof(value_type) < alignof(size_type) ?
+            alignof(size_type) - alignof(value_type) : 0;
+
+        // Number of slot sized units in front of the slots of n buckets.
+        static size_type headerUnits(size_type n) {
+            size_type bytes = storeHash ? hashesOffset(n) + hashesSlack + n * sizeof(size_type) : n + ctrlTail;
+            return (bytes + sizeof(value_type) - 1) / sizeof(value_type);
+        }
+
+        // Leaves the %hash_map untouched if the allocation throws.
+        void initTable(size_type n) {
+            ctrl_t* ctrl = emptyCtrl();
+            value_type* data = nullptr;
+            size_type* hashes = nullptr;
+            if (n > 0) {
+                value_type* block = mAlloc.allocate(headerUnits(n) + n);
+                ctrl = reinterpret_cast<ctrl_t*>(block);
+                data = block + headerUnits(n);
+                if constexpr (storeHash) {
+                    void* first = reinterpret_cast<char*>(block) + hashesOffset(n);
+                    size_type space = hashesSlack + n * sizeof(size_type);
+                    hashes = static_cast<size_type*>(std::align(alignof(size_type), n * sizeof(size_type), first, space));
+                }
+                std::fill(ctrl, ctrl + n, EMPTY);
+                std::fill(ctrl + n, ctrl + n + ctrlTail, SENTINEL);
+            }
+            mCapacity = n;
+            mCtrl = ctrl;
+            mData = data;
+            mHashes = hashes;
+            mIndex.reset(n);
+        }
+
+        void deallocateTable(ctrl_t* ctrl, size_type n) {
+            if (n > 0)
+                mAlloc.deallocate(reinterpret_cast<value_type*>(ctrl), headerUnits(n) + n);
+        }
+
+        // Leaves the control bytes as they are.
+        void destroyElements() {
+            if constexpr (!std::is_trivially_destructible<value_type>::value) {
+                for (size_type i = 0; i < bucket_count(); i++) {
+                    if (isFull(mCtrl[i]))
+                        mData[i].~value_type();
+                }
+            }
+        }
+
+        void destroyTable() {
+            destroyElements();
+            deallocateTable(mCtrl, bucket_count());
+        }
+
+        // Takes the control bytes and the stored hashes of a table with the
+        // same number of buckets.
+        void copyCtrl(const hash_map& src) {
+            if (bucket_count() > 0) {
+                std::memcpy(mCtrl, src.mCtrl, bucket_count() + ctrlTail);
+                if constexpr (storeHash)
+                    std::memcpy(mHashes, src.mHashes, bucket_count() * sizeof(size_type));
+            }
+        }
+
+        void copyTable(const hash_map& src) {
+            initTable(src.bucket_count());
+            copyCtrl(src);
+            for (size_type i = 0; i < bucket_count(); i++) {
+                if (isFull(mCtrl[i])) {
+                    new(mData + i) value_type(src.mData[i]);
+                }
+            }
+            copyOldTable(src);
+        }
+
+        // Returns the table and the slot holding k, the table is nullptr if
+        // there is none.
+        template <typename _Kt>
+        std::pair<const hash_map*, size_type> lookup(const _Kt& k, size_type hash) const {
+            size_type probes = 0;
+            std::pair<const hash_map*, size_type> loc(nullptr, size_type(0));
+            size_type indx = findIndex(k, hash, probes);
+            if (indx != bucket_count()) {
+                loc = std::make_pair(this, indx);
+            } else if (mOld) {
+                indx = mOld->findIndex(k, hash, probes);
+                if (indx != mOld->bucket_count())
+                    loc = std::make_pair(static_cast<const hash_map*>(mOld.get()), indx);
+            }
+            FEFU_HASH_MAP_COUNT(finds, 1);
+            FEFU_HASH_MAP_COUNT(find_probes, probes);
+            return loc;
+        }
+
+        template <typename _Kt>
+        std::pair<hash_map*, size_type> lookup(const _Kt& k, size_type hash) {
+            std::pair<const hash_map*, size_type> loc = static_cast<const hash_map&>(*this).lookup(k, hash);
+            return std::make_pair(const_cast<hash_map*>(loc.first), loc.second);
+        }
 
-        const size_t capacityGrowth = 6;
+        template <typename _Kt>
+        iterator innerFind(const _Kt& x, size_type hash) {
+            std::pair<hash_map*, size_type> loc = lookup(x, hash);
+            if (loc.first == nullptr)
+                return end();
+            return loc.first->iteratorAt(loc.second);
+        }
+
+        template <typename _Kt>
+        const_iterator innerFind(const _Kt& x, size_type hash) const {
+            std::pair<const hash_map*, size_type> loc = lookup(x, hash);
+            if (loc.first == nullptr)
+                return cend();
+            return const_iterator(loc.first->mCtrl + loc.second, loc.first->mData + loc.second);
+        }
+
+        template <typename _Kt>
+        mapped_type& innerAt(const _Kt& k) {
+            std::pair<hash_map*, size_type> loc = lookup(k, mHash(k));
+            if (loc.first == nullptr) {
+                throw std::out_of_range("This key is not presented in map");
+            }
+
+            return loc.first->mData[loc.second].second;
+        }
+
+        template <typename _Kt>
+        const mapped_type& innerAt(const _Kt& k) const {
+            std::pair<const hash_map*, size_type> loc = lookup(k, mHash(k));
+            if (loc.first == nullptr) {
+                throw std::out_of_range("This key is not presented in map");
+            }
+
+            return loc.first->mData[loc.second].second;
+        }
+
+        template <typename _Kt>
+        size_type innerErase(const _Kt& x, size_type hash) {
+            std::pair<hash_map*, size_type> loc = lookup(x, hash);
+            if (loc.first == nullptr) {
+                migrateStep();
+                return 0;
+            }
+            loc.first->eraseAt(loc.second);
+            migrateStep();
+            checkForShrink();
+            return 1;
+        }
+
+        template <typename _Kt>
+        size_type innerBucket(const _Kt& k) const {
+            size_type hash = mHash(k);
+            std::pair<const hash_map*, size_type> loc = lookup(k, hash);
+            if (loc.first == nullptr) {
+                throw std::out_of_range("This key is not presented in map");
+            }
+            // elements not migrated yet belong to their home bucket
+            return loc.first == this ? loc.second : mIndex.index(hash);
+        }
+
+        // Hashes up to lookupBatch keys and prefetches their home slots,
+        // returns the end of the batch.
+        template <typename _ForwardIterator>
+        _ForwardIterator prefetchBatch(_ForwardIterator first, _ForwardIterator last, size_type* hashes) const {
+            for (size_type i = 0; i < lookupBatch && first != last; ++first, ++i) {
+                hashes[i] = mHash(static_cast<const key_type&>(*first));
+                prefetchHome(hashes[i]);
+            }
+            return first;
+        }
+
+        void prefetchHome(size_type hash) const {
+            if (bucket_count() > 0) {
+                size_type home = mIndex.index(hash);
+                prefetch(mCtrl + home);
+                prefetch(mData + home);
+            }
+        }
+
+        iterator iteratorAt(size_type indx) {
+            return iterator(mCtrl + indx, mData + indx);
+        }
+
+        // An iterator which passes over the slots from skip to the end of the table.
+        iterator iteratorAt(size_type indx, const ctrl_t* skip) {
+            iterator it;
+            it.ctrl = mCtrl + indx;
+            it.slot = mData + indx;
+            it.skip = skip;
+            it.skipEmpty();
+            return it;
+        }
+
+        bool ownsSlot(const ctrl_t* ctrl) const {
+            std::less<const ctrl_t*> less;
+            return !less(ctrl, mCtrl) && less(ctrl, mCtrl + bucket_count());
+        }
+
+        // Makes iteration continue into next after the last slot.
+        void linkTo(hash_map& next) {
+            TableLink link{ next.mCtrl, next.mData };
+            mCtrl[bucket_count()] = LINK;
+            std::memcpy(mCtrl + bucket_count() + Group::width, &link, sizeof(link));
+        }
+
+        void copyOldTable(const hash_map& src) {
+            if (!src.mOld)
+                return;
+            mOld.reset(new hash_map(*src.mOld, mAlloc));
+            mMigrated = src.mMigrated;
+            mOld->linkTo(*this);
+        }
+
+        // Keeps the current table as the one being migrated and starts
+        // filling a new one with at least n buckets.
+        void startIncrementalRehash(size_type n) {
+            n = IndexPolicy::round_bucket_count(std::max(n, static_cast<size_type>(std::ceil(mCount / maxLoadFactor))));
+            std::unique_ptr<hash_map> old(new hash_map(mAlloc));
+            old->mHash = mHash;
+            old->mKeyEqual = mKeyEqual;
+            old->maxLoadFactor = maxLoadFactor;
+            old->mIndex = mIndex;
+            old->mCount = mCount;
+            old->mDeleted = mDeleted;
+            ctrl_t* oldCtrl = mCtrl;
+            value_type* oldData = mData;
+            size_type* oldHashes = mHashes;
+            size_type oldCapacity = mCapacity;
+
+            // the previous table only changes hands once the new one exists
+            initTable(n);
+            old->mCtrl = oldCtrl;
+            old->mCapacity = oldCapacity;
+            old->mData = oldData;
+            old->mHashes = oldHashes;
+            mOld = std::move(old);
+            mCount = 0;
+            mDeleted = 0;
+            mMigrated = 0;
+            mPeak = mOld->mCount;
+            mOld->linkTo(*this);
+        }
+
+        // Moves the element of the given slot of the previous table here.
+        void migrateSlot(size_type indx) {
+            size_type hash = mOld->hashAt(indx);
+            std::pair<size_type, ctrl_t> slot = findInsertSlot(hash);
+            relocate(mData + slot.first, mOld->mData + indx);
+            commitSlot(slot, hash);
+            if (mPinned != nullptr && mPinned->first == mOld.get() && mPinned->second == indx)
+                *mPinned = std::make_pair(this, slot.first);
+            mOld->vacateAt(indx);
+        }
+
+        // Migrates up to mIncrementalStep slots of the previous table, or as
+        // many as it takes to be done before the insertions left until the
+        // next growth run out, and drops it once it is empty.
+        void migrateStep() {
+            if (!mOld)
+                return;
+            size_type remaining = mOld->bucket_count() - mMigrated;
+            // a Robin Hood migration visits the slot it emptied again
+            if constexpr (CollisionPolicy::robin_hood)
+                remaining += mOld->mCount;
+            size_type limit = static_cast<size_type>(maxLoadFactor * bucket_count());
+            size_type used = size() + mDeleted;
+            size_type steps = used < limit ? (remaining + limit - used - 1) / (limit - used) : remaining;
+            steps = std::max(steps, mIncrementalStep);
+            for (size_type step = 0; step < steps && mOld->mCount > 0; step++) {
+                if (isFull(mOld->mCtrl[mMigrated])) {
+                    migrateSlot(mMigrated);
+                    // Robin Hood erase shifts the next element into the slot
+                    if constexpr (CollisionPolicy::robin_hood)
+                        continue;
+                }
+                mMigrated++;
+            }
+            if (mOld->mCount == 0)
+                mOld.reset();
+        }
+
+        // Runs the migration step of an operation once the operation is done,
+        // so that its arguments may still refer to elements of the table.
+        // Returns where the element at loc is afterwards.
+        std::pair<hash_map*, size_type> migrateAfter(std::pair<hash_map*, size_type> loc) {
+            if (!mOld)
+                return loc;
+            mPinned = &loc;
+            mOld->mPinned = &loc;
+            try {
+                migrateStep();
+            } catch (...) {
+                unpin();
+                throw;
+            }
+            unpin();
+            return loc;
+        }
+
+        void unpin() {
+            mPinned = nullptr;
+            if (mOld)
+                mOld->mPinned = nullptr;
+        }
+
+        void finishRehash() {
+            if (!mOld)
+                return;
+            for (; mOld->mCount > 0; mMigrated++) {
+                while (isFull(mOld->mCtrl[mMigrated]))
+                    migrateSlot(mMigrated);
+            }
+            mOld.reset();
+        }
+
+        // Returns the slot holding k or bucket_count() if there is none and
+        // adds the slots or groups it probed to probes.
+        template <typename _Kt>
+        size_type findIndex(const _Kt& k, size_type hash, size_type& probes) const {
+            if (mCount == 0)
+                return bucket_count();
+            if constexpr (CollisionPolicy::robin_hood) {
+                size_type indx = mIndex.index(hash);
+                probes++;
+                for (int dist = 0; mCtrl[indx] >= storedDistance(dist); dist++) {
+                    if (mCtrl[indx] == storedDistance(dist) && hashMatches(indx, hash)
+                        && mKeyEqual(mData[indx].first, k))
+                        return indx;
+                    indx = nextSlot(indx);
+                    probes++;
+                }
+                return bucket_count();
+            } else {
+                size_type mixed = hashMix(hash);
+                ctrl_t h2 = hashFragment(mixed);
+                ProbeSeq seq(mIndex.index(hash), mixed, bucket_count());
+                while (true) {
+                    probes++;
+                    Group group(mCtrl + seq.base());
+                    for (uint32_t match = group.match(h2); match != 0; match &= match - 1) {
+                        size_type indx = seq.base() + countTrailingZeros(match);
+                        if (hashMatches(indx, hash) && mKeyEqual(mData[indx].first, k))
+                            return indx;
+                    }
+                    if (group.matchEmpty() != 0)
+                        return bucket_count();
+                    seq.next();
+                }
+            }
+        }
+
+        // Returns the first free slot of the probe sequence, preferring the
+        // home slot and the slots after it inside a group.
+        size_type findInsertIndex(size_type hash) const {
+            ProbeSeq seq(mIndex.index(hash), hashMix(hash), bucket_count());
+            for (size_type probes = 1; ; probes++) {
+                uint32_t free = Group(mCtrl + seq.base()).matchEmptyOrDeleted();
+                if (free != 0) {
+                    FEFU_HASH_MAP_COUNT(inserts, 1);
+                    FEFU_HASH_MAP_COUNT(insert_probes, probes);
+                    uint32_t afterHome = free & (~0u << seq.offset());
+                    return seq.base() + countTrailingZeros(afterHome != 0 ? afterHome : free);
+                }
+                seq.next();
+            }
+        }
+
+        // Inserts x unless it is already there, provided its probe sequence
+        // ends before it leaves the slots [regionFirst, regionLast), which no
+        // other thread touches. Returns false if it leaves them first.
+        template <typename _T>
+        bool placeInRegion(const _T& x, size_type hash, size_type regionFirst, size_type regionLast,
+            size_type& placed, size_type& reused) {
+            size_type mixed = hashMix(hash);
+            ctrl_t h2 = hashFragment(mixed);
+            ProbeSeq seq(mIndex.index(hash), mixed, bucket_count());
+            size_type indx = bucket_count();
+            while (seq.base() >= regionFirst && seq.base() < regionLast) {
+                Group group(mCtrl + seq.base());
+                for (uint32_t match = group.match(h2); match != 0; match &= match - 1) {
+                    size_type found = seq.base() + countTrailingZeros(match);
+                    if (hashMatches(found, hash) && mKeyEqual(mData[found].first, x.first))
+                        return true;
+                }
+                uint32_t free = group.matchEmptyOrDeleted();
+                if (indx == bucket_count() && free != 0) {
+                    uint32_t afterHome = free & (~0u << seq.offset());
+                    indx = seq.base() + countTrailingZeros(afterHome != 0 ? afterHome : free);
+                }
+                if (group.matchEmpty() != 0) {
+                    new(mData + indx) value_type(x);
+                    if (mCtrl[indx] == DELETED)
+                        reused++;
+                    mCtrl[indx] = h2;
+                    if constexpr (storeHash)
+                        mHashes[indx] = hash;
+                    placed++;
+                    return true;
+                }
+                seq.next();
+            }
+            return false;
+        }
+
+        // Calls work(t) for every t below threads, each on its own thread but
+        // work(0), which runs on the calling one together with the calls no
+        // thread could be started for. The first exception thrown by a call
+        // is rethrown once all of them have finished.
+        template <typename _F>
+        static void runParallel(size_type threads, const _F& work) {
+            std::vector<std::exception_ptr> errors(threads);
+            auto run = [&](size_type t) {
+                try {
+                    work(t);
+                } catch (...) {
+                    errors[t] = std::current_exception();
+                }
+            };
+            std::vector<std::thread> workers;
+            size_type started = 1;
+            try {
+                workers.reserve(threads - 1);
+                for (; started < threads; started++)
+                    workers.emplace_back(run, started);
+            } catch (...) {
+                // the calls no thread could be started for run below
+            }
+            run(0);
+            for (size_type t = started; t < threads; t++)
+                run(t);
+            for (std::thread& worker : workers)
+                worker.join();
+            for (std::exception_ptr& error : errors) {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+        }
+
+        // Claims the first empty slot of the probe sequence for a rehashed
+        // element while other threads claim slots for theirs. Slots only ever
+        // go from EMPTY to full, so a group seen without an empty slot stays
+        // so and the probe sequences remain valid for lookups.
+        size_type claimInsertIndex(size_type hash) {
+            size_type mixed = hashMix(hash);
+            ctrl_t h2 = hashFragment(mixed);
+            ProbeSeq seq(mIndex.index(hash), mixed, bucket_count());
+            while (true) {
+                for (size_type i = 0; i < Group::width; i++) {
+                    size_type indx = seq.base() + (seq.offset() + i) % Group::width;
+                    if (indx < bucket_count() && loadCtrl(mCtrl + indx) == EMPTY && claimCtrl(mCtrl + indx, EMPTY, h2))
+                        return indx;
+                }
+                seq.next();
+            }
+        }
+
+        // Returns a free slot for a key which is not in the table together
+        // with the control byte it should get. Robin Hood makes the slot free
+        // by shifting the richer elements one slot forward.
+        std::pair<size_type, ctrl_t> findInsertSlot(size_type hash) {
+            if constexpr (CollisionPolicy::robin_hood) {
+                size_type indx = mIndex.index(hash);
+                int dist = 0;
+                while (mCtrl[indx] >= storedDistance(dist)) {
+                    // saturated distances keep the Robin Hood order by the exact ones
+                    if (dist > CollisionPolicy::max_distance && mCtrl[indx] == CollisionPolicy::max_distance
+                        && homeDistance(indx) < static_cast<size_type>(dist))
+                        break;
+                    indx = nextSlot(indx);
+                    dist++;
+                }
+                FEFU_HASH_MAP_COUNT(inserts, 1);
+                FEFU_HASH_MAP_COUNT(insert_probes, dist + 1);
+                if (mCtrl[indx] != EMPTY) {
+                    size_type last = indx;
+                    while (mCtrl[last] != EMPTY)
+                        last = nextSlot(last);
+                    while (last != indx) {
+                        size_type prev = prevSlot(last);
+                        moveSlot(last, prev);
+                        mCtrl[last] = storedDistance(mCtrl[prev] + 1);
+                        last = prev;
+                    }
+                    mCtrl[indx] = EMPTY;
+                }
+                return std::make_pair(indx, storedDistance(dist));
+            } else {
+                return std::make_pair(findInsertIndex(hash), hashFragment(hashMix(hash)));
+            }
+        }
+
+        // Returns a free slot for a new element with the given hash, growing
+        // the table if one more element would exceed the load factor.
+        std::pair<size_type, ctrl_t> prepareInsert(size_type hash) {
+            mPeak = std::max(mPeak, size() + 1);
+            if constexpr (!CollisionPolicy::robin_hood) {
+                if (bucket_count() > 0) {
+                    size_type indx = findInsertIndex(hash);
+                    if (mCtrl[indx] == DELETED || !checkForRehash())
+                        return std::make_pair(indx, hashFragment(hashMix(hash)));
+                    return findInsertSlot(hash);
+                }
+            }
+            checkForRehash();
+            return findInsertSlot(hash);
+        }
+
+        template <typename... _Args>
+        void constructAt(std::pair<size_type, ctrl_t> slot, size_type hash, _Args&&... args) {
+            if constexpr (CollisionPolicy::robin_hood) {
+                try {
+                    new(mData + slot.first) value_type(std::forward<_Args>(args)...);
+                } catch (...) {
+                    // findInsertSlot() shifted the richer elements forward
+                    shiftBack(slot.first);
+                    throw;
+                }
+            } else {
+                new(mData + slot.first) value_type(std::forward<_Args>(args)...);
+            }
+            commitSlot(slot, hash);
+        }
+
+        void commitSlot(std::pair<size_type, ctrl_t> slot, size_type hash) {
+            if (mCtrl[slot.first] == DELETED)
+                mDeleted--;
+            mCtrl[slot.first] = slot.second;
+            if constexpr (storeHash)
+                mHashes[slot.first] = hash;
+            mCount++;
+        }
+
+        size_type eraseAt(size_type indx) {
+            mData[indx].~value_type();
+            return vacateAt(indx);
+        }
+
+        // Frees a slot whose element was destroyed or moved out.
+        // Returns the number of elements moved back into the freed slots.
+        size_type vacateAt(size_type indx) {
+            size_type shifted = 0;
+            if constexpr (CollisionPolicy::robin_hood) {
+                shifted = shiftBack(indx);
+            } else {
+                // No probe sequence passes a group which still has an empty slot,
+                // so the slot may become empty instead of a tombstone.
+                size_type base = indx - indx % Group::width;
+                if (Group(mCtrl + base).matchEmpty() != 0) {
+                    mCtrl[indx] = EMPTY;
+                } else {
+                    mCtrl[indx] = DELETED;
+                    mDeleted++;
+                }
+            }
+            mCount--;
+            return shifted;
+        }
+
+        // Robin Hood backward shift: moves the displaced elements after the
+        // free slot indx one slot back, so no tombstone is left. Returns the
+        // number of moved elements; the shift wraps the element of the first
+        // slot around to the last one when it goes past the end of the table.
+        size_type shiftBack(size_type indx) {
+            size_type shifted = 0;
+            size_type next = nextSlot(indx);
+            while (mCtrl[next] > 0) {
+                shifted++;
+                ctrl_t dist = mCtrl[next] == CollisionPolicy::max_distance ?
+                    storedDistance(static_cast<int>(homeDistance(next)) - 1) : mCtrl[next] - 1;
+                moveSlot(indx, next);
+                mCtrl[indx] = dist;
+                indx = next;
+                next = nextSlot(next);
+            }
+            mCtrl[indx] = EMPTY;
+            return shifted;
+        }
+
+        // Moves an element into uninitialized memory and destroys the source.
+        // The source dies right after, so even its const key is moved from
+        // instead of being copied. Both ways rely on implementation behaviour
+        // rather than the standard: std::pair is not trivially copyable, so
+        // copying its bytes is not sanctioned, and moving from the key
+        // modifies a const object. They hold on the supported compilers since
+        // the slots are storage from the allocator in which the elements were
+        // built with placement new, and nothing reads the source afterwards.
+        static void relocate(value_type* dst, value_type* src) {
+            if constexpr (is_trivially_relocatable<value_type>::value) {
+                std::memcpy(static_cast<void*>(dst), static_cast<const void*>(src), sizeof(value_type));
+            } else {
+                new(dst) value_type(std::move(const_cast<key_type&>(src->first)), std::move(src->second));
+                src->~value_type();
+            }
+        }
+
+        // Moves a full slot of this table into a free one.
+        void moveSlot(size_type dst, size_type src) {
+            relocate(mData + dst, mData + src);
+            if constexpr (storeHash)
+                mHashes[dst] = mHashes[src];
+            if (mPinned != nullptr && mPinned->first == this && mPinned->second == src)
+                mPinned->second = dst;
+        }
+
+        size_type hashAt(size_type indx) const {
+            if constexpr (storeHash)
+                return mHashes[indx];
+            else
+                return mHash(mData[indx].first);
+        }
+
+        // False only if the slot surely holds another key.
+        bool hashMatches(size_type indx, size_type hash) const {
+            if constexpr (storeHash)
+                return mHashes[indx] == hash;
+            else
+                return true;
+        }
+
+        static ctrl_t storedDistance(int dist) {
+            return static_cast<ctrl_t>(std::min(dist, static_cast<int>(robin_hood_policy::max_distance)));
+        }
 
-        inline size_type innerHash(size_type n) const {
-            return (64567 * (n + 1) + 5672) % 655360001;
+        static void addToHistogram(std::vector<size_type>& histogram, size_type length) {
+            if (histogram.size() < length)
+                histogram.resize(length);
+            histogram[length - 1]++;
         }
-        //hasher innerHash;
 
-        size_type innerSearch(const key_type& k, bool forFind = true) const {
-            size_type indx = mHash(k) % bucket_count();
-            size_type d = innerHash(indx);
-            d += (d % 2) == 0;
-            while (!mKeyEqual(mData[indx].first, k) && (mNodes[indx].state == CONTAINS) || mNodes[indx].state == DELETED) {
-                indx = (indx + d) % bucket_count();
+        size_type nextSlot(size_type indx) const {
+            return indx + 1 == bucket_count() ? 0 : indx + 1;
+        }
+
+        size_type prevSlot(size_type indx) const {
+            return indx == 0 ? bucket_count() - 1 : indx - 1;
+        }
+
+        // Exact probe distance of a full slot.
+        size_type homeDistance(size_type indx) const {
+            size_type home = mIndex.index(hashAt(indx));
+            return indx >= home ? indx - home : indx + bucket_count() - home;
+        }
+
+        // Rehashes the elements within the current buckets to get rid of the
+        // tombstones. The elements still to place are marked DELETED, so a
+        // slot found for one of them is either EMPTY or holds another element
+        // to place, which is swapped with it and placed next. The groups
+        // probed before that slot hold placed elements only and stay full.
+        // Neither Hash nor the moves may throw while the elements are marked.
+        void dropDeleted() {
+            for (size_type i = 0; i < bucket_count(); i++)
+                mCtrl[i] = isFull(mCtrl[i]) ? DELETED : EMPTY;
+            for (size_type i = 0; i < bucket_count(); i++) {
+                if (mCtrl[i] != DELETED)
+                    continue;
+                size_type hash = hashAt(i);
+                size_type target = findInsertIndex(hash);
+                ctrl_t h2 = hashFragment(hashMix(hash));
+                if (target / Group::width == i / Group::width) {
+                    mCtrl[i] = h2;
+                } else if (mCtrl[target] == EMPTY) {
+                    moveSlot(target, i);
+                    mCtrl[target] = h2;
+                    mCtrl[i] = EMPTY;
+                } else {
+                    swapSlots(target, i);
+                    mCtrl[target] = h2;
+                    i--;
+                }
             }
+            mDeleted = 0;
+        }
 
-            return indx;
+        void swapSlots(size_type a, size_type b) {
+            typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type tmp;
+            value_type* buffer = reinterpret_cast<value_type*>(&tmp);
+            relocate(buffer, mData + a);
+            relocate(mData + a, mData + b);
+            relocate(mData + b, buffer);
+            if constexpr (storeHash)
+                std::swap(mHashes[a], mHashes[b]);
         }
 
         bool checkForRehash() {
-            if (mNodes.size() < 2) {
+            if (bucket_count() < 2) {
                 rehash(2);
                 return true;
             }
-            if (load_factor() >= maxLoadFactor) {
-                rehash(mNodes.size() * capacityGrowth);
+            // the elements still to migrate count, so they always fit
+            if (size() + mDeleted + 1 > maxLoadFactor * bucket_count()) {
+                // tombstones rather than elements fill the table, the elements
+                // keep a quarter of the room free so compacting stays amortized
+                if (mDeleted > 0 && 4 * (size() + 1) <= 3 * maxLoadFactor * bucket_count()) {
+                    if constexpr (nothrowHash && nothrowRelocate)
+                        dropDeleted();
+                    else
+                        rehash(bucket_count());
+                } else if (mIncrementalStep == 0) {
+                    rehash(GrowthPolicy::grow(bucket_count()));
+                } else {
+                    finishRehash();
+                    startIncrementalRehash(GrowthPolicy::grow(bucket_count()));
+                }
                 return true;
             }
             return false;
         }
 
-        size_type getPowerOfTwo(size_type n) {
-            n--;
-            n |= n >> 1;
-            n |= n >> 2;
-            n |= n >> 4;
-            n |= n >> 8;
-            n |= n >> 16;
-            n++;
-            return n;
+        // The key inside the emplace() arguments, see HasEmplaceKey.
+        template <typename _First, typename... _Rest>
+        static const key_type& emplacedKey(const _First& first, const _Rest&... rest) {
+            if constexpr (sizeof...(_Rest) == 0) {
+                return first.first;
+            } else if constexpr (sizeof...(_Rest) == 1) {
+                return first;
+            } else {
+                return std::get<0>(std::get<0>(std::tie(rest...)));
+            }
         }
 
-        template <typename _T>
-        std::pair<iterator, bool> innerInsert(_T&& el) {
-            checkForRehash();
-
-            size_type indx = innerSearch(el.first);
-            if (mNodes[indx].state == EMPTY) {
-                new (mData + indx) value_type(std::forward<_T>(el));
-                mNodes[indx].state = CONTAINS;
-                mCount++;
-                return make_pair(iterator(&mNodes[indx]), true);
+        // Constructs value_type(args...) right in its slot unless the key k,
+        // which args build, is already present.
+        template <typename _Kt, typename... _Args>
+        std::pair<iterator, bool> innerEmplace(size_type hash, const _Kt& k, _Args&&... args) {
+            std::pair<hash_map*, size_type> loc = lookup(k, hash);
+            bool inserted = loc.first == nullptr;
+            if (inserted) {
+                std::pair<size_type, ctrl_t> slot = prepareInsert(hash);
+                constructAt(slot, hash, std::forward<_Args>(args)...);
+                loc = std::make_pair(this, slot.first);
             }
+            loc = migrateAfter(loc);
 
-            return make_pair(iterator(&mNodes[indx]), false);
+            return std::make_pair(loc.first->iteratorAt(loc.second), inserted);
+        }
+
+        // Shrinks the table to a load factor halfway between the water marks
+        // once it falls under the low one and under half of the most elements
+        // it held since the last resize.
+        void checkForShrink() {
+            if (minLoadFactor == 0.0f || size() >= minLoadFactor * bucket_count() || size() >= mPeak / 2)
+                return;
+            float target = (minLoadFactor + maxLoadFactor) / 2;
+            size_type n = IndexPolicy::round_bucket_count(static_cast<size_type>(std::ceil(size() / target)));
+            if (n < bucket_count())
+                rehash(n);
         }
 
         template <typename _T>
-        mapped_type& innerOperator(_T&& k) {
-            checkForRehash();
+        std::pair<iterator, bool> innerInsert(_T&& el, size_type hash) {
+            return innerEmplace(hash, el.first, std::forward<_T>(el));
+        }
 
-            size_type indx = innerSearch(k);
-            if (mNodes[indx].state == EMPTY) {
-                indx = innerSearch(k, false);
-                new(mData + indx) value_type(std::forward<_T>(k), mapped_type());
-                mNodes[indx].state = CONTAINS;
-                mCount++;
+        template <typename _T>
+        mapped_type& innerOperator(_T&& k, size_type hash) {
+            std::pair<hash_map*, size_type> loc = lookup(k, hash);
+            if (loc.first == nullptr) {
+                std::pair<size_type, ctrl_t> slot = prepareInsert(hash);
+                constructAt(slot, hash, std::piecewise_construct,
+                    std::forward_as_tuple(std::forward<_T>(k)), std::tuple<>());
+                loc = std::make_pair(this, slot.first);
             }
+            loc = migrateAfter(loc);
 
-            return mData[indx].second;
+            return loc.first->mData[loc.second].second;
         }
 
         template<typename _T>
         void innerMerge(_T&& source) {
-            for (auto it = source.begin(); it != source.end(); it++) {
+            for (auto it = source.begin(); it != source.end();) {
                 if (!contains(it->first)) {
                     insert(std::forward<value_type>(*it));
-                    source.erase(it);
+                    it = source.erase(it);
+                } else {
+                    it++;
                 }
             }
             return;
         }
 
         template<typename... _Args, typename _T>
-        std::pair<iterator, bool> innerTryEmplace(_T&& k, _Args&&... args) {
-            checkForRehash();
-
-            size_type indx = innerSearch(k);
-            if (mNodes[indx].state == EMPTY) {
-                new (mData + indx) value_type(std::piecewise_construct,
-                    std::forward_as_tuple(std::forward<_T>(k)),
-                    std::forward_as_tuple(std::forward<_Args>(args)...));
-                mNodes[indx].state = CONTAINS;
-                mCount++;
-                return make_pair(iterator(&mNodes[indx]), true);
-            }
-
-            return make_pair(iterator(&mNodes[indx]), false);
+        std::pair<iterator, bool> innerTryEmplace(size_type hash, _T&& k, _Args&&... args) {
+            return innerEmplace(hash, k, std::piecewise_construct,
+                std::forward_as_tuple(std::forward<_T>(k)),
+                std::forward_as_tuple(std::forward<_Args>(args)...));
         }
 
         template <typename _Obj, typename _T>
         std::pair<iterator, bool> innerInsertAssign(_T&& k, _Obj&& obj) {
-            checkForRehash();
-
-            size_type indx = innerSearch(k);
-            if (mNodes[indx].state == EMPTY) {
-                indx = innerSearch(k, false);
-                new(mData + indx) value_type(std::forward<_T>(k), mapped_type(std::move(obj)));
-                mNodes[indx].state = CONTAINS;
-                mCount++;
-                return std::make_pair(iterator(&mNodes[indx]), true);
+            size_type hash = mHash(k);
+            std::pair<hash_map*, size_type> loc = lookup(k, hash);
+            bool inserted = loc.first == nullptr;
+            if (inserted) {
+                std::pair<size_type, ctrl_t> slot = prepareInsert(hash);
+                constructAt(slot, hash, std::forward<_T>(k), std::forward<_Obj>(obj));
+                loc = std::make_pair(this, slot.first);
+            } else {
+                loc.first->mData[loc.second].second = std::move(obj);
             }
-            mData[indx].second = std::move(obj);
-            
-            return std::make_pair(iterator(&mNodes[indx]), false);
+            loc = migrateAfter(loc);
+
+            return std::make_pair(loc.first->iteratorAt(loc.second), inserted);
         }
 
     };
 
-} // namespace fefu
\ No newline at end of file
+} // namespace fefu